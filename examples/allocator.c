@@ -0,0 +1,140 @@
+/*
+ * examples/allocator.c
+ *
+ * Run a script with all memory outside of the object slabs coming
+ * from a custom allocator, see sheep_set_allocator().  Every block
+ * carries a header, so memory freed or resized through the hooks
+ * that did not come from them is caught, and the runtime has to
+ * give back everything by the time it is gone.
+ *
+ *   make examples
+ *   LD_LIBRARY_PATH=sheep examples/allocator examples/test.sheep
+ *
+ * Copyright (c) 2010 Johannes Weiner <hannes@cmpxchg.org>
+ */
+#include <sheep/compile.h>
+#include <sheep/eval.h>
+#include <sheep/read.h>
+#include <sheep/util.h>
+#include <sheep/vm.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define MAGIC	0x5eeb5eebUL
+
+/* Padded to keep the blocks aligned like malloc() does */
+struct header {
+	unsigned long magic;
+	size_t size;
+};
+
+/* The hooks are called from the collector threads as well */
+static unsigned long nr_allocs;
+static size_t nr_bytes;
+
+static struct header *check(void *mem)
+{
+	struct header *header = (struct header *)mem - 1;
+
+	if (header->magic != MAGIC) {
+		fprintf(stderr, "allocator: foreign block %p\n", mem);
+		abort();
+	}
+	return header;
+}
+
+static void *account(struct header *header, size_t size)
+{
+	if (!header)
+		return NULL;
+	header->magic = MAGIC;
+	header->size = size;
+	__sync_fetch_and_add(&nr_bytes, size);
+	return header + 1;
+}
+
+static void *test_alloc(size_t size, void *data)
+{
+	__sync_fetch_and_add(&nr_allocs, 1);
+	return account(malloc(sizeof(struct header) + size), size);
+}
+
+static void *test_realloc(void *mem, size_t size, void *data)
+{
+	struct header *header = check(mem);
+
+	__sync_fetch_and_sub(&nr_bytes, header->size);
+	header->magic = 0;
+	header = realloc(header, sizeof(struct header) + size);
+	return account(header, size);
+}
+
+static void test_free(void *mem, void *data)
+{
+	struct header *header = check(mem);
+
+	__sync_fetch_and_sub(&nr_bytes, header->size);
+	header->magic = 0;
+	free(header);
+}
+
+static const struct sheep_allocator allocator = {
+	.alloc = test_alloc,
+	.realloc = test_realloc,
+	.free = test_free,
+};
+
+static int run(struct sheep_vm *vm, const char *path)
+{
+	struct sheep_reader reader;
+	int ret = 1;
+	FILE *in;
+
+	in = fopen(path, "r");
+	if (!in) {
+		perror(path);
+		return 1;
+	}
+	sheep_reader_init(&reader, path, in);
+	while (1) {
+		struct sheep_expr *expr;
+		sheep_t fun;
+
+		expr = sheep_read(&reader, vm);
+		if (!expr)
+			goto out;
+		if (expr->object == &sheep_eof) {
+			sheep_free_expr(vm, expr);
+			break;
+		}
+		fun = sheep_compile(vm, expr);
+		sheep_free_expr(vm, expr);
+		if (!fun || !sheep_eval(vm, fun, 0))
+			goto out;
+	}
+	ret = 0;
+out:
+	fclose(in);
+	return ret;
+}
+
+int main(int ac, char **av)
+{
+	struct sheep_vm vm;
+	int ret;
+
+	if (ac < 2) {
+		fprintf(stderr, "usage: %s script [args...]\n", av[0]);
+		return 1;
+	}
+	sheep_set_allocator(&allocator);
+	sheep_vm_init(&vm, ac - 1, av + 1, NULL);
+	ret = run(&vm, av[1]);
+	sheep_vm_exit(&vm);
+
+	fprintf(stderr, "allocator: %lu allocations, %zu bytes outstanding\n",
+		nr_allocs, nr_bytes);
+	if (!nr_allocs || nr_bytes)
+		ret = 1;
+	return ret;
+}
@@ -12,13 +12,31 @@ struct sheep_vm;
 
 typedef sheep_t (*sheep_alien_t)(struct sheep_vm *, unsigned int);
 
+/* Arguments of a signature, see sheep_make_alien_sig() */
+#define SHEEP_ALIEN_ARGS	8
+/* nr_max of aliens checking their arguments themselves */
+#define SHEEP_ALIEN_UNCHECKED	0xff
+
+/**
+ * struct sheep_alien - function implemented in C
+ * @function: the implementation
+ * @name: name for printing
+ * @nr_min: minimum number of arguments
+ * @nr_max: maximum number of arguments, or SHEEP_ALIEN_UNCHECKED
+ * @args: argument types, compiled from the signature
+ */
 struct sheep_alien {
 	sheep_alien_t function;
 	const char *name;
+	unsigned char nr_min;
+	unsigned char nr_max;
+	unsigned char args[SHEEP_ALIEN_ARGS];
 };
 
 extern const struct sheep_type sheep_alien_type;
 
 sheep_t sheep_make_alien(struct sheep_vm *, sheep_alien_t, const char *);
+sheep_t sheep_make_alien_sig(struct sheep_vm *, sheep_alien_t, const char *,
+			     const char *);
 
 #endif /* _SHEEP_ALIEN_H */
@@ -32,20 +32,119 @@ enum sheep_opcode {
 	/*15*/SHEEP_BRF,
 	/*16*/SHEEP_BR,
 	/*17*/SHEEP_LOAD,
+	/*18*/SHEEP_ARENA,
+	/*19*/SHEEP_LEAVE,
+	/* Superinstructions, see sheep_code_finalize() */
+	/*20*/SHEEP_CALL_GLOBAL,
+	/*21*/SHEEP_TAILCALL_GLOBAL,
+	/*22*/SHEEP_LOCAL_LOCAL,
+	/*23*/SHEEP_BRF_DROP,
+	/*24*/SHEEP_SET_LOCAL_KEEP,
+	/*25*/SHEEP_SET_FOREIGN_KEEP,
+	/* Builtin operators, see sheep_vm_operator() */
+	/*26*/SHEEP_ADD,
+	/*27*/SHEEP_SUB,
+	/*28*/SHEEP_MUL,
+	/*29*/SHEEP_LT,
+	/*30*/SHEEP_LE,
+	/*31*/SHEEP_GT,
+	/*32*/SHEEP_GE,
+	/*33*/SHEEP_EQ,
 };
 
-#define SHEEP_OPCODE_BITS	5
+#define SHEEP_NR_OPERATORS	(SHEEP_EQ - SHEEP_ADD + 1)
+#define SHEEP_NR_OPCODES	(SHEEP_EQ + 1)
+
+#define SHEEP_OPCODE_BITS	6
 #define SHEEP_OPCODE_SHIFT	(sizeof(long) * 8 - SHEEP_OPCODE_BITS)
 
+/*
+ * The evaluator runs threaded code where the compiler can take the
+ * addresses of labels, build with SHEEP_SWITCH_DISPATCH defined to
+ * use the portable switch instead.
+ */
+#if defined(__GNUC__) && !defined(SHEEP_SWITCH_DISPATCH)
+#define SHEEP_THREADED
+#endif
+
+/**
+ * struct sheep_insn_counts - instruction execution counters
+ * @enabled: whether the evaluator counts
+ * @ops: executions per opcode
+ * @pairs: executions per opcode, by the opcode of the instruction
+ *         before it, where that was its neighbour in the code
+ * @lastp: the instruction executed last
+ * @last: its opcode
+ *
+ * With SHEEP_COUNTS defined at build time, the evaluator counts the
+ * instructions it executes, per opcode, per pair of neighbouring
+ * opcodes and per instruction of every function, when SHEEP_COUNTS
+ * is set in the environment.  The histograms are printed when the
+ * runtime exits, the counts per instruction by `disassemble'.
+ */
+struct sheep_insn_counts {
+	int enabled;
+	unsigned long ops[SHEEP_NR_OPCODES];
+	unsigned long pairs[SHEEP_NR_OPCODES][SHEEP_NR_OPCODES];
+	unsigned long *lastp;
+	enum sheep_opcode last;
+};
+
+#define SHEEP_HASH_WAYS		4
+
+/**
+ * struct sheep_hash_cache - inline cache of a HASH or SET_HASH site
+ * @key: key slot of the name looked up
+ * @next: way to replace on the next miss
+ * @ids: identities of the modules and typeclasses looked into
+ * @indices: where the name was found in them
+ *
+ * The name maps of modules and typeclasses never change, see
+ * sheep_vm_id().
+ */
+struct sheep_hash_cache {
+	unsigned int key;
+	unsigned int next;
+	unsigned long ids[SHEEP_HASH_WAYS];
+	unsigned int indices[SHEEP_HASH_WAYS];
+};
+
+/**
+ * struct sheep_code - function code
+ * @code: encoded instructions
+ * @labels: branch targets, while compiling
+ * @max_stack: maximum depth of the operand stack, computed by
+ *             sheep_code_finalize()
+ * @caches: inline caches of the HASH and SET_HASH instructions,
+ *          which refer to them by index
+ * @threaded: handler address and operand per instruction, built
+ *            from @code by sheep_code_finalize()
+ * @counts: executions per instruction, see struct sheep_insn_counts
+ */
 struct sheep_code {
 	struct sheep_vector code;
 	struct sheep_vector labels;
+	unsigned int max_stack;
+	struct sheep_hash_cache *caches;
+#ifdef SHEEP_THREADED
+	unsigned long *threaded;
+#endif
+#ifdef SHEEP_COUNTS
+	unsigned long *counts;
+#endif
 };
 
 static inline void sheep_code_exit(struct sheep_code *code)
 {
 	sheep_free(code->code.items);
 	sheep_free(code->labels.items);
+	sheep_free(code->caches);
+#ifdef SHEEP_THREADED
+	sheep_free(code->threaded);
+#endif
+#ifdef SHEEP_COUNTS
+	sheep_free(code->counts);
+#endif
 }
 
 static inline unsigned long sheep_encode(enum sheep_opcode op, unsigned int arg)
@@ -65,6 +164,13 @@ static inline void sheep_decode(unsigned long code,
 	*arg = code & ((1UL << SHEEP_OPCODE_SHIFT) - 1);
 }
 
+/*
+ * Superinstructions fused from two instructions with an operand
+ * each carry the second operand in the upper bits.
+ */
+#define SHEEP_OPERAND_BITS	16
+#define SHEEP_OPERAND_MASK	((1U << SHEEP_OPERAND_BITS) - 1)
+
 static inline unsigned long sheep_emit(struct sheep_code *code,
 				       enum sheep_opcode op,
 				       unsigned int arg)
@@ -84,4 +190,8 @@ void sheep_code_dump(struct sheep_vm *,
 
 void sheep_code_disassemble(struct sheep_code *);
 
+#ifdef SHEEP_COUNTS
+void sheep_code_histogram(struct sheep_insn_counts *);
+#endif
+
 #endif /* _SHEEP_CODE_H */
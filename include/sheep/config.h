@@ -0,0 +1,3 @@
+#define SHEEP_VERSION "0.1.3"
+#define SHEEP_NAME "Klaatu"
+#define SHEEP_MODDIR "/usr/lib/sheep-0.1.3"
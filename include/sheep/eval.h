@@ -8,10 +8,14 @@
 
 #include <sheep/object.h>
 #include <sheep/list.h>
+#include <sheep/code.h>
 #include <sheep/vm.h>
 #include <stdarg.h>
 
 sheep_t sheep_eval(struct sheep_vm *, sheep_t, int);
+#ifdef SHEEP_THREADED
+const void *const *sheep_eval_handlers(void);
+#endif
 sheep_t sheep_apply(struct sheep_vm *, sheep_t, struct sheep_list *);
 sheep_t sheep_call(struct sheep_vm *, sheep_t, unsigned int, ...);
 
@@ -56,6 +56,7 @@ void sheep_foreign_save(struct sheep_vm *, unsigned long);
 
 /* life-time */
 void sheep_foreign_mark(struct sheep_vector *);
+void sheep_foreign_forward(struct sheep_vector *);
 void sheep_foreign_release(struct sheep_vm *, struct sheep_vector *);
 
 #endif /* _SHEEP_FOREIGN_H */
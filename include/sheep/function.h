@@ -17,6 +17,8 @@ struct sheep_function {
 	unsigned int nr_locals;
 
 	const char *name;
+	/* Source line of the definition */
+	unsigned long line;
 	unsigned int nr_parms;
 	struct sheep_vector *foreign;
 };
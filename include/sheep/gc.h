@@ -6,16 +6,266 @@
 #ifndef _SHEEP_GC_H
 #define _SHEEP_GC_H
 
+#include <sheep/number.h>
+#include <sheep/vector.h>
 #include <sheep/types.h>
 
+struct sheep_finalizer;
+struct release_batch;
+struct sheep_markers;
 struct sheep_vm;
 
-struct sheep_object *sheep_gc_alloc(struct sheep_vm *);
+#define SHEEP_BITS_PER_LONG	(sizeof(long) * 8)
+
+#define SHEEP_SLAB_SHIFT	20
+#define SHEEP_SLAB_SIZE		(1UL << SHEEP_SLAB_SHIFT)
+
+/* Cell sizes of the slab size classes, header included */
+#define SHEEP_CELL_MIN_SHIFT	5
+#define SHEEP_CELL_MAX_SHIFT	8
+#define SHEEP_CELL_CLASSES	(SHEEP_CELL_MAX_SHIFT - SHEEP_CELL_MIN_SHIFT + 1)
+
+#define SHEEP_SLAB_WORDS	((SHEEP_SLAB_SIZE >> SHEEP_CELL_MIN_SHIFT) / \
+				 SHEEP_BITS_PER_LONG)
+
+/**
+ * struct sheep_slab - naturally aligned chunk of object memory
+ * @next: list linkage
+ * @nr_used: number of allocated cells
+ * @cursor: allocation bitmap word to continue searching from
+ * @shift: log2 of the cell size
+ * @first: first bitmap word not covering the header
+ * @nr_words: bitmap words in use for this cell size
+ * @flags: SHEEP_SLAB_* state bits
+ * @alloc: bitmap of allocated cells
+ * @marks: bitmap of marked cells
+ * @final: bitmap of cells whose objects need finalization
+ *
+ * The header lives at the beginning of the slab itself, the cells
+ * it covers are never handed out.
+ */
+struct sheep_slab {
+	struct sheep_slab *next;
+	unsigned int nr_used;
+	unsigned int cursor;
+	unsigned int shift;
+	unsigned int first;
+	unsigned int nr_words;
+	unsigned int flags;
+	unsigned long alloc[SHEEP_SLAB_WORDS];
+	unsigned long marks[SHEEP_SLAB_WORDS];
+	unsigned long final[SHEEP_SLAB_WORDS];
+};
+
+/* The slab's marks have not been swept yet */
+#define SHEEP_SLAB_UNSWEPT	1U
+/* The slab is referenced from the native stack */
+#define SHEEP_SLAB_PINNED	2U
+/* The slab belongs to the current allocation region */
+#define SHEEP_SLAB_ARENA	4U
+/* The region slab holds objects that outlive the region in place */
+#define SHEEP_SLAB_ESCAPED	8U
+
+/**
+ * struct sheep_cells - slabs of one size class
+ * @nursery: slabs allocated into since the last collection
+ * @parts: partially used slabs
+ * @fulls: full slabs
+ * @unswept: slabs marked but not yet swept
+ */
+struct sheep_cells {
+	struct sheep_slab *nursery;
+	struct sheep_slab *parts;
+	struct sheep_slab *fulls;
+	struct sheep_slab *unswept;
+};
+
+/*
+ * Objects too big for the largest cell size are allocated
+ * individually, prefixed by this header.
+ */
+struct sheep_large {
+	struct sheep_large *next;
+	size_t size;
+	unsigned long marked;
+};
+
+static inline struct sheep_large *sheep_large(sheep_t sheep)
+{
+	return (struct sheep_large *)sheep - 1;
+}
+
+static inline struct sheep_slab *sheep_slab(sheep_t sheep)
+{
+	return (struct sheep_slab *)((unsigned long)sheep &
+				     ~(SHEEP_SLAB_SIZE - 1));
+}
+
+static inline unsigned long sheep_slab_index(sheep_t sheep)
+{
+	return ((unsigned long)sheep & (SHEEP_SLAB_SIZE - 1)) >>
+		sheep_slab(sheep)->shift;
+}
+
+/* Heap object, as opposed to fixnums and static objects? */
+static inline int sheep_gc_object(sheep_t sheep)
+{
+	if (!sheep || sheep_is_fixnum(sheep))
+		return 0;
+	return sheep->flags & SHEEP_GC_HEAP;
+}
+
+static inline int sheep_gc_marked(sheep_t sheep)
+{
+	unsigned long index;
+
+	if (sheep->flags & SHEEP_GC_LARGE)
+		return sheep_large(sheep)->marked;
+
+	index = sheep_slab_index(sheep);
+	return (sheep_slab(sheep)->marks[index / SHEEP_BITS_PER_LONG] >>
+		(index % SHEEP_BITS_PER_LONG)) & 1;
+}
+
+/**
+ * struct sheep_gc_policy - heap growth policy
+ * @growth: heap size that triggers the next full collection, in
+ *          percent of the heap size after the last one
+ * @min_heap: heap size in bytes below which no full collection is
+ *            triggered
+ * @pause: time budget of one marking slice in microseconds, 0 to
+ *         do full collections in one go
+ * @threads: number of threads marking in parallel whenever a
+ *           collection marks in one go
+ *
+ * The nursery, the bytes allocated between two collections, scales
+ * with the resulting target heap size.
+ */
+struct sheep_gc_policy {
+	unsigned long growth;
+	size_t min_heap;
+	unsigned long pause;
+	unsigned int threads;
+};
+
+/**
+ * struct sheep_arena - allocation region
+ * @depth: number of nested enters, only the outermost one counts
+ * @slabs: the region's slabs per size class, the current one first
+ * @spare: slabs of earlier regions kept for reuse
+ * @nr_spare: number of spare slabs
+ * @escapes: pairs of objects outside of the region and the region
+ *           objects stored into them
+ * @globals: global slots region objects were stored into
+ * @remembered: remembered set entries that predate the region
+ * @batch: finalizations of discarded objects not yet submitted
+ *
+ * See sheep_gc_arena_enter().
+ */
+struct sheep_arena {
+	unsigned int depth;
+	struct sheep_slab *slabs[SHEEP_CELL_CLASSES];
+	struct sheep_slab *spare;
+	unsigned int nr_spare;
+	struct sheep_vector escapes;
+	struct sheep_vector globals;
+	unsigned long remembered;
+	struct release_batch *batch;
+};
+
+/* Slots of the per-type allocation counters */
+#define SHEEP_GC_TYPES		32
+
+/**
+ * struct sheep_gc_stats - collector statistics
+ * @nr_minor: minor collections
+ * @nr_major: completed major collections
+ * @total_pause: time spent in the collector in microseconds
+ * @max_pause: longest single pause in microseconds
+ * @nr_slabs_allocated: slabs mapped
+ * @nr_slabs_released: slabs unmapped
+ * @nr_evacuated: objects moved out of sparse slabs
+ * @types: object types, hashed by address
+ * @nr_allocated: objects allocated per type
+ *
+ * A marking slice counts as a pause of its own, only the slice that
+ * completes a major collection counts as a collection.
+ */
+struct sheep_gc_stats {
+	unsigned long nr_minor;
+	unsigned long nr_major;
+	unsigned long total_pause;
+	unsigned long max_pause;
+	unsigned long nr_slabs_allocated;
+	unsigned long nr_slabs_released;
+	unsigned long nr_evacuated;
+	const struct sheep_type *types[SHEEP_GC_TYPES];
+	unsigned long nr_allocated[SHEEP_GC_TYPES];
+};
+
+void sheep_gc_init(struct sheep_vm *, const struct sheep_gc_policy *);
+void sheep_gc_tune(struct sheep_vm *, const struct sheep_gc_policy *);
+
+struct sheep_object *sheep_gc_alloc(struct sheep_vm *,
+				    const struct sheep_type *, size_t);
+struct sheep_object *sheep_gc_alloc_n(struct sheep_vm *,
+				      const struct sheep_type *,
+				      size_t, unsigned long, size_t);
 
 void sheep_mark(sheep_t);
 void sheep_protect(struct sheep_vm *, sheep_t);
 void sheep_unprotect(struct sheep_vm *, sheep_t);
 
+/*
+ * The current location of an object: objects evacuated by a major
+ * collection leave their new address behind in their old cell,
+ * until all references are updated.
+ */
+static inline sheep_t sheep_forward(sheep_t sheep)
+{
+	if (sheep_gc_object(sheep) && (sheep->flags & SHEEP_GC_FORWARDED))
+		return *(sheep_t *)(sheep + 1);
+	return sheep;
+}
+
+/*
+ * Marks are sticky between collections: every object that survived
+ * a collection stays marked and is thus old, everything allocated
+ * since is young.
+ */
+static inline int sheep_gc_young(sheep_t sheep)
+{
+	return sheep_gc_object(sheep) && !sheep_gc_marked(sheep);
+}
+
+/*
+ * Whether an object survives the collection that is settling weak
+ * references, see struct sheep_type
+ */
+static inline int sheep_gc_alive(sheep_t sheep)
+{
+	return !sheep_gc_object(sheep) || sheep_gc_marked(sheep);
+}
+
+void sheep_gc_weak(struct sheep_vm *, sheep_t);
+
+/* Object allocated into the current region? */
+static inline int sheep_gc_arena_object(sheep_t sheep)
+{
+	if (!sheep_gc_object(sheep) || (sheep->flags & SHEEP_GC_LARGE))
+		return 0;
+	return sheep_slab(sheep)->flags & SHEEP_SLAB_ARENA;
+}
+
+void sheep_gc_arena_enter(struct sheep_vm *);
+sheep_t sheep_gc_arena_exit(struct sheep_vm *, sheep_t, unsigned long);
+void __sheep_gc_escape(struct sheep_vm *, sheep_t, sheep_t);
+void __sheep_gc_escape_global(struct sheep_vm *, unsigned int);
+
+void __sheep_gc_remember(struct sheep_vm *, sheep_t);
+void __sheep_gc_shade(struct sheep_vm *, sheep_t);
+
+void sheep_gc_builtins(struct sheep_vm *);
 void sheep_gc_exit(struct sheep_vm *);
 
 #endif /* _SHEEP_GC_H */
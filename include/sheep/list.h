@@ -7,7 +7,9 @@
 #define _SHEEP_LIST_H
 
 #include <sheep/object.h>
+#include <sheep/vm.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 struct sheep_vm;
 
@@ -19,6 +21,7 @@ struct sheep_list {
 extern const struct sheep_type sheep_list_type;
 
 sheep_t sheep_make_cons(struct sheep_vm *, sheep_t, sheep_t);
+sheep_t sheep_make_conses(struct sheep_vm *, size_t);
 sheep_t sheep_make_list(struct sheep_vm *, unsigned int, ...);
 
 static inline struct sheep_list *sheep_list(sheep_t sheep)
@@ -26,6 +29,22 @@ static inline struct sheep_list *sheep_list(sheep_t sheep)
 	return sheep_data(sheep);
 }
 
+static inline void sheep_list_set_head(struct sheep_vm *vm,
+				       sheep_t sheep,
+				       sheep_t head)
+{
+	sheep_list(sheep)->head = head;
+	sheep_gc_write(vm, sheep, head);
+}
+
+static inline void sheep_list_set_tail(struct sheep_vm *vm,
+				       sheep_t sheep,
+				       sheep_t tail)
+{
+	sheep_list(sheep)->tail = tail;
+	sheep_gc_write(vm, sheep, tail);
+}
+
 int sheep_list_search(struct sheep_list *, sheep_t, size_t *);
 
 void sheep_list_builtins(struct sheep_vm *);
@@ -16,6 +16,7 @@ struct sheep_module {
 	const char *name;
 	struct sheep_map env;
 	void *handle;
+	unsigned long id;
 };
 
 extern const struct sheep_type sheep_module_type;
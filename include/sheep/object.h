@@ -9,7 +9,7 @@
 #include <sheep/number.h>
 #include <sheep/types.h>
 
-sheep_t sheep_make_object(struct sheep_vm *, const struct sheep_type *, void *);
+sheep_t sheep_make_object(struct sheep_vm *, const struct sheep_type *, size_t);
 
 static inline const struct sheep_type *sheep_type(sheep_t sheep)
 {
@@ -18,9 +18,10 @@ static inline const struct sheep_type *sheep_type(sheep_t sheep)
 	return sheep->type;
 }
 
+/* The payload is allocated inline, right after the header */
 static inline void *sheep_data(sheep_t sheep)
 {
-	return (void *)(sheep->data & ~1);
+	return (void *)(sheep + 1);
 }
 
 int sheep_test(sheep_t);
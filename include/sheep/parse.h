@@ -11,6 +11,7 @@
 #include <sheep/list.h>
 #include <stdarg.h>
 
+unsigned long sheep_parser_line(struct sheep_compile *, sheep_t);
 void sheep_parser_error(struct sheep_compile *, sheep_t, const char *, ...);
 
 int __sheep_parse(struct sheep_compile *,
@@ -0,0 +1,51 @@
+/*
+ * include/sheep/profile.h
+ *
+ * Copyright (c) 2010 Johannes Weiner <hannes@cmpxchg.org>
+ */
+#ifndef _SHEEP_PROFILE_H
+#define _SHEEP_PROFILE_H
+
+#include <sheep/object.h>
+#include <sheep/vector.h>
+#include <sheep/map.h>
+#include <signal.h>
+#include <stdio.h>
+
+struct sheep_vm;
+
+/**
+ * struct sheep_profile - sampling profiler state
+ * @pending: set by the timer signal, cleared when the sample is taken
+ * @depth: number of nested starts, only the outermost one counts
+ * @forms: the starts of (profile expr) forms still evaluating
+ * @nr_samples: samples taken since the outermost start
+ * @samples: the distinct call stacks sampled, see struct sheep_sample
+ * @index: the same, by their folded call stack
+ * @start: global slot of the alien (profile expr) starts with
+ * @stop: global slot of the alien (profile expr) stops with
+ *
+ * See sheep_profile_start().
+ */
+struct sheep_profile {
+	volatile sig_atomic_t pending;
+	unsigned int depth;
+	unsigned int forms;
+	unsigned long nr_samples;
+	struct sheep_vector samples;
+	struct sheep_map index;
+	unsigned int start;
+	unsigned int stop;
+};
+
+int sheep_profile_start(struct sheep_vm *);
+void sheep_profile_stop(struct sheep_vm *);
+void sheep_profile_unwind(struct sheep_vm *);
+
+void sheep_profile_sample(struct sheep_vm *, sheep_t);
+void sheep_profile_report(struct sheep_vm *, FILE *, FILE *);
+
+void sheep_profile_init(struct sheep_vm *);
+void sheep_profile_exit(struct sheep_vm *);
+
+#endif /* _SHEEP_PROFILE_H */
@@ -34,7 +34,7 @@ struct sheep_expr {
 
 extern struct sheep_object sheep_eof;
 
-void sheep_free_expr(struct sheep_expr *);
+void sheep_free_expr(struct sheep_vm *, struct sheep_expr *);
 struct sheep_expr *sheep_read(struct sheep_reader *, struct sheep_vm *);
 
 #endif /* _SHEEP_READ_H */
@@ -20,6 +20,7 @@ struct sheep_string {
 extern const struct sheep_type sheep_string_type;
 
 sheep_t __sheep_make_string(struct sheep_vm *, const char *, size_t);
+sheep_t sheep_copy_string(struct sheep_vm *, const char *, size_t);
 sheep_t sheep_make_string(struct sheep_vm *, const char *);
 
 static inline struct sheep_string *sheep_string(sheep_t sheep)
@@ -13,8 +13,7 @@ struct sheep_vm;
 
 struct sheep_typeobject {
 	sheep_t class;
-	sheep_t *values;
-	struct sheep_map map;
+	sheep_t values[];
 };
 
 extern const struct sheep_type sheep_typeobject_type;
@@ -23,6 +22,8 @@ struct sheep_typeclass {
 	const char *name;
 	const char **names;
 	unsigned int nr_slots;
+	struct sheep_map map;	/* slot name -> index */
+	unsigned long id;	/* see sheep_vm_id() */
 };
 
 extern const struct sheep_type sheep_typeclass_type;
@@ -36,6 +36,23 @@ struct sheep_type {
 
 	void (*mark)(sheep_t);
 	void (*free)(struct sheep_vm *, sheep_t);
+	/* Finalizer not touching the vm, run on a copy of the payload */
+	void (*release)(void *);
+	/*
+	 * Update the references of an object the collector might
+	 * have moved, see sheep_forward().  Types holding references
+	 * to other objects or pointers into their own payload must
+	 * provide it for the collector to move any objects.
+	 */
+	void (*forward)(sheep_t);
+	/*
+	 * Weak references, see sheep_gc_weak(): once marking is
+	 * done, ephemeron marks what is reachable through live keys
+	 * and reports whether it marked anything, until nothing new
+	 * turns up, then weak drops the references to dead objects.
+	 */
+	int (*ephemeron)(sheep_t);
+	void (*weak)(sheep_t);
 
 	int (*compile)(struct sheep_compile *,
 		       struct sheep_function *,
@@ -57,7 +74,14 @@ struct sheep_type {
 
 struct sheep_object {
 	const struct sheep_type *type;
-	unsigned long data;
+	unsigned long flags;
 };
 
+/* Garbage collector bits in sheep->flags */
+#define SHEEP_GC_HEAP		1UL
+#define SHEEP_GC_REMEMBERED	2UL
+#define SHEEP_GC_LARGE		4UL
+#define SHEEP_GC_FORWARDED	8UL
+#define SHEEP_GC_ESCAPED	16UL
+
 #endif /* _SHEEP_TYPES_H */
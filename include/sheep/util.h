@@ -15,12 +15,61 @@
 #define __noreturn
 #endif
 
+/**
+ * struct sheep_allocator - memory allocation hooks
+ * @alloc: allocate @size bytes, NULL on failure
+ * @realloc: resize an allocation, NULL on failure
+ * @free: release an allocation
+ * @data: passed along to the hooks
+ *
+ * All memory outside of the object slabs is allocated through these
+ * hooks, see sheep_set_allocator().  They are called from the
+ * collector's marker and finalizer threads as well, and have to be
+ * thread-safe.
+ */
+struct sheep_allocator {
+	void *(*alloc)(size_t, void *);
+	void *(*realloc)(void *, size_t, void *);
+	void (*free)(void *, void *);
+	void *data;
+};
+
+void sheep_set_allocator(const struct sheep_allocator *);
+
 void *sheep_malloc(size_t);
 void *sheep_zalloc(size_t);
 void *sheep_realloc(void *, size_t);
 char *sheep_strdup(const char *);
 void sheep_free(const void *);
 
+/* Size classes of the caches: 16, 32, 64 and 128 bytes */
+#define SHEEP_CACHE_MIN_SHIFT	4
+#define SHEEP_CACHE_MAX_SHIFT	7
+#define SHEEP_CACHE_CLASSES	(SHEEP_CACHE_MAX_SHIFT - SHEEP_CACHE_MIN_SHIFT + 1)
+
+/**
+ * struct sheep_cache - cache of small fixed-size allocations
+ * @free: free lists per size class
+ * @chunks: memory the free lists are carved from
+ * @nr_bytes: bytes currently handed out
+ * @nr_chunk_bytes: bytes allocated for chunks
+ *
+ * Not thread-safe, allocations have to be freed to the cache they
+ * came from, passing their size.  Chunk memory is only given back
+ * when the cache is destroyed.
+ */
+struct sheep_cache {
+	void *free[SHEEP_CACHE_CLASSES];
+	void *chunks;
+	size_t nr_bytes;
+	size_t nr_chunk_bytes;
+};
+
+void *sheep_cache_alloc(struct sheep_cache *, size_t);
+void *sheep_cache_zalloc(struct sheep_cache *, size_t);
+void sheep_cache_free(struct sheep_cache *, const void *, size_t);
+void sheep_cache_exit(struct sheep_cache *);
+
 struct sheep_strbuf {
 	char *bytes;
 	size_t nr_bytes;
@@ -7,19 +7,59 @@
 #define _SHEEP_VM_H
 
 #include <sheep/function.h>
+#include <sheep/profile.h>
 #include <sheep/module.h>
 #include <sheep/object.h>
 #include <sheep/vector.h>
 #include <sheep/alien.h>
+#include <sheep/util.h>
 #include <sheep/map.h>
+#include <sheep/gc.h>
 #include <stdarg.h>
 
+/**
+ * struct sheep_frame - saved state of a calling function
+ * @codep: the call instruction, execution continues after it
+ * @basep: stack index of the caller's locals
+ * @function: the caller
+ */
+struct sheep_frame {
+	unsigned long *codep;
+	unsigned long basep;
+	sheep_t function;
+};
+
 struct sheep_vm {
 	/* Object management */
-	struct sheep_objects *fulls;
-	struct sheep_objects *parts;
+	struct sheep_cells cells[SHEEP_CELL_CLASSES];
+	struct sheep_slab *empty;
+	unsigned int nr_empty;
+	struct sheep_large *young_large;
+	struct sheep_large *old_large;
+	size_t large_size;
+	unsigned long nr_young;
+	unsigned int nr_slabs;
+	struct sheep_gc_policy gc_policy;
+	size_t gc_marked;
+	size_t gc_old;
+	size_t gc_live;
+	size_t gc_target;
+	size_t gc_budget;
+	struct sheep_vector remembered;
 	struct sheep_vector protected;
+	struct sheep_vector gray;
+	struct sheep_vector young_weak;
+	struct sheep_vector old_weak;
+	struct sheep_arena arena;
+	int gc_marking;
 	int gc_disabled;
+	int gc_trace;
+	struct sheep_gc_stats gc_stats;
+	struct sheep_finalizer *finalizer;
+	struct sheep_markers *markers;
+
+	/* Small internal structures, see struct sheep_cache */
+	struct sheep_cache cache;
 
 	char **keys;
 	struct sheep_vector globals;
@@ -28,12 +68,22 @@ struct sheep_vm {
 	struct sheep_map specials;
 	struct sheep_map builtins;
 	struct sheep_module main;
+	sheep_t operators[SHEEP_NR_OPERATORS];
 
 	/* Evaluator */
 	struct sheep_indirect *pending;
 	struct sheep_vector stack;
-	struct sheep_vector calls;	/* [lastpc lastbasep lastfunction] */
+	struct sheep_frame *frames;
+	unsigned long nr_frames;
+	unsigned long max_frames;
+	unsigned long last_id;
 	char *error;
+
+	/* Profiler */
+	struct sheep_profile profile;
+#ifdef SHEEP_COUNTS
+	struct sheep_insn_counts counts;
+#endif
 };
 
 void sheep_error(struct sheep_vm *, const char *, ...);
@@ -41,11 +91,86 @@ void sheep_report_error(struct sheep_vm *, sheep_t);
 
 unsigned int sheep_vm_key(struct sheep_vm *, const char *);
 
+void sheep_vm_mark_frames(struct sheep_vm *);
 void sheep_vm_mark(struct sheep_vm *);
 
+/*
+ * Region objects stored into an object outside of the allocation
+ * region survive the region, see sheep_gc_arena_exit().  The stack
+ * is checked when the region is left, closed-over variables are
+ * found through their closures.
+ */
+static inline void sheep_gc_arena_write(struct sheep_vm *vm,
+					sheep_t object,
+					sheep_t value)
+{
+	if (!vm->arena.depth || !sheep_gc_arena_object(value))
+		return;
+	if (!sheep_gc_arena_object(object))
+		__sheep_gc_escape(vm, object, value);
+}
+
+/**
+ * sheep_gc_write - write barrier
+ * @vm: runtime
+ * @object: object written into, NULL for roots like globals and
+ *          closed-over variables
+ * @value: the value that was stored
+ *
+ * Must be called after storing a reference into an object or a
+ * root that is not rescanned at the end of marking.  Outside of
+ * incremental marking, this lets minor collections find young
+ * objects only referenced from the old generation.  During
+ * marking, it shades the stored value so the marker does not miss
+ * it when the old location was already scanned.
+ *
+ * Stores into stack slots need no barrier, the stack is rescanned.
+ */
+static inline void sheep_gc_write(struct sheep_vm *vm,
+				  sheep_t object,
+				  sheep_t value)
+{
+	if (object)
+		sheep_gc_arena_write(vm, object, value);
+	if (vm->gc_marking) {
+		if (sheep_gc_object(value) && !sheep_gc_marked(value))
+			__sheep_gc_shade(vm, value);
+		return;
+	}
+	if (object && sheep_gc_young(object))
+		return;
+	if (!sheep_gc_young(value))
+		return;
+	if (value->flags & SHEEP_GC_REMEMBERED)
+		return;
+	__sheep_gc_remember(vm, value);
+}
+
+/* Region objects stored into globals survive the region */
+static inline void sheep_gc_arena_global(struct sheep_vm *vm,
+					 unsigned int slot)
+{
+	if (vm->arena.depth && sheep_gc_arena_object(vm->globals.items[slot]))
+		__sheep_gc_escape_global(vm, slot);
+}
+
+static inline void sheep_vm_set_global(struct sheep_vm *vm,
+				       unsigned int slot,
+				       sheep_t sheep)
+{
+	vm->globals.items[slot] = sheep;
+	sheep_gc_arena_global(vm, slot);
+	sheep_gc_write(vm, NULL, sheep);
+}
+
 static inline unsigned int sheep_vm_constant(struct sheep_vm *vm, sheep_t sheep)
 {
-	return sheep_vector_push(&vm->globals, sheep);
+	unsigned int slot;
+
+	slot = sheep_vector_push(&vm->globals, sheep);
+	sheep_gc_arena_global(vm, slot);
+	sheep_gc_write(vm, NULL, sheep);
+	return slot;
 }
 
 static inline unsigned int sheep_vm_global(struct sheep_vm *vm)
@@ -60,10 +185,44 @@ static inline unsigned int sheep_vm_global(struct sheep_vm *vm)
 	return sheep_vector_push(&vm->globals, &sheep_nil);
 }
 
+/*
+ * Unique identity of a module or typeclass for the inline caches,
+ * which outlives the object and survives it being moved.  0 is
+ * never handed out.
+ */
+static inline unsigned long sheep_vm_id(struct sheep_vm *vm)
+{
+	return ++vm->last_id;
+}
+
 unsigned int sheep_vm_variable(struct sheep_vm *, const char *, sheep_t);
 void sheep_vm_function(struct sheep_vm *, const char *, sheep_alien_t);
+void sheep_vm_function_sig(struct sheep_vm *, const char *, sheep_alien_t,
+			   const char *);
+void sheep_vm_operator(struct sheep_vm *, const char *, sheep_alien_t,
+		       const char *, enum sheep_opcode);
+
+/*
+ * The arguments of an alien function with a signature, checked
+ * already, see sheep_make_alien_sig().  They stay on the stack, and
+ * so alive, until the function returns.  Pushing onto the stack,
+ * like calling back into sheep code does, can move it: take them
+ * out before.
+ */
+static inline sheep_t *sheep_alien_args(struct sheep_vm *vm,
+					unsigned int nr_args)
+{
+	return (sheep_t *)vm->stack.items + vm->stack.nr_items - nr_args;
+}
 
-void sheep_vm_init(struct sheep_vm *, int, char **);
+/*
+ * A vm can be set up and used on different threads, but only by one
+ * thread at a time.  Collections scan the native stack of the thread
+ * that runs into them, objects held only by the native code of other
+ * threads have to be protected, see sheep_protect().
+ */
+void sheep_vm_init(struct sheep_vm *, int, char **,
+		   const struct sheep_gc_policy *);
 void sheep_vm_exit(struct sheep_vm *);
 
 #endif /* _SHEEP_VM_H */
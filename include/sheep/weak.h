@@ -0,0 +1,47 @@
+/*
+ * include/sheep/weak.h
+ *
+ * Copyright (c) 2010 Johannes Weiner <hannes@cmpxchg.org>
+ */
+#ifndef _SHEEP_WEAK_H
+#define _SHEEP_WEAK_H
+
+#include <sheep/object.h>
+
+struct sheep_vm;
+
+/* Reference that does not keep its object alive, NULL once cleared */
+struct sheep_weak {
+	sheep_t object;
+};
+
+extern const struct sheep_type sheep_weak_type;
+
+sheep_t sheep_make_weak(struct sheep_vm *, sheep_t);
+
+struct sheep_ephemeron {
+	sheep_t key;
+	sheep_t value;
+};
+
+/*
+ * Table whose entries live only as long as their keys: a value is
+ * kept alive by its table only while its key is reachable from
+ * elsewhere.  Numbers and strings are compared by value, everything
+ * else by identity.  Keys that are not heap objects never go away.
+ */
+struct sheep_weak_table {
+	struct sheep_ephemeron *entries;
+	unsigned long nr_entries;
+	unsigned long nr_used;
+};
+
+extern const struct sheep_type sheep_weak_table_type;
+
+sheep_t sheep_make_weak_table(struct sheep_vm *);
+sheep_t sheep_weak_table_get(sheep_t, sheep_t);
+void sheep_weak_table_set(struct sheep_vm *, sheep_t, sheep_t, sheep_t);
+
+void sheep_weak_builtins(struct sheep_vm *);
+
+#endif /* _SHEEP_WEAK_H */
@@ -28,13 +28,9 @@ static int file_close(struct file *file)
 	return 1;
 }
 
-static void file_free(struct sheep_vm *vm, sheep_t sheep)
+static void file_release(void *payload)
 {
-	struct file *file;
-
-	file = sheep_data(sheep);
-	file_close(file);
-	sheep_free(file);
+	file_close(payload);
 }
 
 static void file_format(sheep_t sheep, struct sheep_strbuf *sb, int repr)
@@ -43,7 +39,7 @@ static void file_format(sheep_t sheep, struct sheep_strbuf *sb, int repr)
 }
 
 static const struct sheep_type file_type = {
-	.free = file_free,
+	.release = file_release,
 	.format = file_format,
 };
 
@@ -52,7 +48,7 @@ static sheep_t open(struct sheep_vm *vm, unsigned int nr_args)
 {
 	struct sheep_string *path;
 	struct file *file;
-	sheep_t write;
+	sheep_t write, sheep;
 	FILE *filp;
 
 	if (sheep_unpack_stack(vm, nr_args, "Sb", &path, &write))
@@ -68,11 +64,11 @@ static sheep_t open(struct sheep_vm *vm, unsigned int nr_args)
 		return NULL;
 	}
 
-	file = sheep_malloc(sizeof(struct file));
+	sheep = sheep_make_object(vm, &file_type, sizeof(struct file));
+	file = sheep_data(sheep);
 	file->filp = filp;
 	file->write = sheep_test(write);
-
-	return sheep_make_object(vm, &file_type, file);
+	return sheep;
 }
 
 /* (close file) */
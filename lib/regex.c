@@ -22,9 +22,8 @@
 static sheep_t match(struct sheep_vm *vm, unsigned int nr_args)
 {
 	regmatch_t matches[MAX_MATCHES];
-	sheep_t regex_, string_, result = NULL;
+	sheep_t regex_, string_, list, result = NULL;
 	const char *regex, *string;
-	struct sheep_list *list;
 	unsigned int i;
 	regex_t reg;
 	int status;
@@ -48,21 +47,16 @@ static sheep_t match(struct sheep_vm *vm, unsigned int nr_args)
 	if (status == REG_NOMATCH)
 		goto out_result;
 
-	list = sheep_list(result);
+	list = result;
 	for (i = 0; i < MAX_MATCHES && matches[i].rm_so != -1; i++) {
-		unsigned long start, end, len;
-		char *sub;
+		unsigned long start, end;
 
 		start = matches[i].rm_so;
 		end = matches[i].rm_eo;
-		len = end - start;
-		sub = sheep_malloc(len + 1);
-		memcpy(sub, string + start, len);
-		sub[len] = 0;
-		list->head = __sheep_make_string(vm, sub, len);
-
-		list->tail = sheep_make_cons(vm, NULL, NULL);
-		list = sheep_list(list->tail);
+		sheep_list_set_head(vm, list,
+			sheep_copy_string(vm, string + start, end - start));
+		sheep_list_set_tail(vm, list, sheep_make_cons(vm, NULL, NULL));
+		list = sheep_list(list)->tail;
 	}
 out_result:
 	sheep_unprotect(vm, result);
@@ -3,16 +3,72 @@
  *
  * Copyright (c) 2009 Johannes Weiner <hannes@cmpxchg.org>
  */
+#include <sheep/function.h>
+#include <sheep/number.h>
 #include <sheep/object.h>
+#include <sheep/string.h>
+#include <sheep/bool.h>
+#include <sheep/list.h>
+#include <sheep/name.h>
 #include <sheep/util.h>
 #include <sheep/vm.h>
+#include <string.h>
+#include <ctype.h>
 #include <stdio.h>
 
 #include <sheep/alien.h>
 
-static void alien_free(struct sheep_vm *vm, sheep_t sheep)
+/*
+ * Argument types of signatures, by their sheep_unpack() control
+ * character.  An argument matches if it is of any of the types,
+ * the first entry takes everything.
+ */
+static const struct argtype {
+	char control;
+	const char *name;
+	const struct sheep_type *types[3];
+} argtypes[] = {
+	{ 'o', NULL, { NULL } },
+	{ 'b', "bool", { &sheep_bool_type } },
+	{ 'n', "number", { &sheep_number_type } },
+	{ 'a', "name", { &sheep_name_type } },
+	{ 's', "string", { &sheep_string_type } },
+	{ 'l', "list", { &sheep_list_type } },
+	{ 'q', "sequence", { &sheep_string_type, &sheep_list_type } },
+	{ 'f', "function", { &sheep_function_type, &sheep_closure_type } },
+	{ 'c', "callable", { &sheep_alien_type, &sheep_function_type,
+			     &sheep_closure_type } },
+};
+
+#define NR_ARGTYPES	(sizeof(argtypes) / sizeof(struct argtype))
+
+static int check_args(struct sheep_vm *vm, struct sheep_alien *alien,
+		      unsigned int nr_args)
 {
-	sheep_free(sheep_data(sheep));
+	sheep_t *args;
+	unsigned int i;
+
+	if (nr_args < alien->nr_min || nr_args > alien->nr_max) {
+		sheep_error(vm, "too %s arguments",
+			nr_args < alien->nr_min ? "few" : "many");
+		return -1;
+	}
+
+	args = (sheep_t *)vm->stack.items + vm->stack.nr_items - nr_args;
+	for (i = 0; i < nr_args; i++) {
+		const struct argtype *want = argtypes + alien->args[i];
+		const struct sheep_type *type;
+
+		if (!alien->args[i])
+			continue;
+		type = sheep_type(args[i]);
+		if (type == want->types[0] || type == want->types[1] ||
+		    type == want->types[2])
+			continue;
+		sheep_error(vm, "expected %s, got %s", want->name, type->name);
+		return -1;
+	}
+	return 0;
 }
 
 static enum sheep_call alien_call(struct sheep_vm *vm,
@@ -24,9 +80,15 @@ static enum sheep_call alien_call(struct sheep_vm *vm,
 	sheep_t value;
 
 	alien = sheep_data(callable);
+	if (alien->nr_max != SHEEP_ALIEN_UNCHECKED &&
+	    check_args(vm, alien, nr_args))
+		return SHEEP_CALL_FAIL;
 	value = alien->function(vm, nr_args);
 	if (!value)
 		return SHEEP_CALL_FAIL;
+	/* Left in place for the function, see sheep_alien_args() */
+	if (alien->nr_max != SHEEP_ALIEN_UNCHECKED)
+		vm->stack.nr_items -= nr_args;
 	*valuep = value;
 	return SHEEP_CALL_DONE;
 }
@@ -44,7 +106,6 @@ static void alien_format(sheep_t sheep, struct sheep_strbuf *sb, int repr)
 
 const struct sheep_type sheep_alien_type = {
 	.name = "alien",
-	.free = alien_free,
 	.call = alien_call,
 	.format = alien_format,
 };
@@ -54,9 +115,57 @@ sheep_t sheep_make_alien(struct sheep_vm *vm,
 			 const char *name)
 {
 	struct sheep_alien *alien;
+	sheep_t sheep;
 
-	alien = sheep_malloc(sizeof(struct sheep_alien));
+	sheep = sheep_make_object(vm, &sheep_alien_type,
+				sizeof(struct sheep_alien));
+	alien = sheep_data(sheep);
+	memset(alien, 0, sizeof(struct sheep_alien));
 	alien->function = function;
 	alien->name = name;
-	return sheep_make_object(vm, &sheep_alien_type, alien);
+	alien->nr_max = SHEEP_ALIEN_UNCHECKED;
+	return sheep;
+}
+
+/**
+ * sheep_make_alien_sig - make an alien function with a signature
+ * @vm: runtime
+ * @function: the implementation
+ * @name: name for printing
+ * @sig: argument types
+ *
+ * @sig holds one sheep_unpack() control character per argument, 't'
+ * aside, the case does not matter.  The arguments following a '|'
+ * are optional.
+ *
+ * The number and types of the arguments are checked before
+ * @function is called, which can then take them from the stack
+ * with sheep_alien_args() as they are.
+ */
+sheep_t sheep_make_alien_sig(struct sheep_vm *vm,
+			     sheep_alien_t function,
+			     const char *name,
+			     const char *sig)
+{
+	struct sheep_alien *alien;
+	unsigned int nr = 0;
+	sheep_t sheep;
+
+	sheep = sheep_make_alien(vm, function, name);
+	alien = sheep_data(sheep);
+	alien->nr_min = strcspn(sig, "|");
+	for (; *sig; sig++) {
+		unsigned int i;
+
+		if (*sig == '|')
+			continue;
+		for (i = 0; i < NR_ARGTYPES; i++)
+			if (argtypes[i].control == tolower(*sig))
+				break;
+		if (i == NR_ARGTYPES || nr == SHEEP_ALIEN_ARGS)
+			sheep_bug("invalid signature for %s", name);
+		alien->args[nr++] = i;
+	}
+	alien->nr_max = nr;
+	return sheep;
 }
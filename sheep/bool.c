@@ -5,7 +5,6 @@
  */
 #include <sheep/compile.h>
 #include <sheep/object.h>
-#include <sheep/unpack.h>
 #include <sheep/util.h>
 #include <sheep/vm.h>
 #include <stdio.h>
@@ -43,12 +42,9 @@ struct sheep_object sheep_false = {
 /* (= a b) */
 static sheep_t builtin_equal(struct sheep_vm *vm, unsigned int nr_args)
 {
-	sheep_t a, b;
+	sheep_t *args = sheep_alien_args(vm, nr_args);
 
-	if (sheep_unpack_stack(vm, nr_args, "oo", &a, &b))
-		return NULL;
-
-	if (sheep_equal(a, b))
+	if (sheep_equal(args[0], args[1]))
 		return &sheep_true;
 	return &sheep_false;
 }
@@ -56,10 +52,7 @@ static sheep_t builtin_equal(struct sheep_vm *vm, unsigned int nr_args)
 /* (bool object) */
 static sheep_t builtin_bool(struct sheep_vm *vm, unsigned int nr_args)
 {
-	sheep_t sheep;
-
-	if (sheep_unpack_stack(vm, nr_args, "o", &sheep))
-		return NULL;
+	sheep_t sheep = *sheep_alien_args(vm, nr_args);
 
 	if (sheep_test(sheep))
 		return &sheep_true;
@@ -69,10 +62,7 @@ static sheep_t builtin_bool(struct sheep_vm *vm, unsigned int nr_args)
 /* (not object) */
 static sheep_t builtin_not(struct sheep_vm *vm, unsigned int nr_args)
 {
-	sheep_t sheep;
-
-	if (sheep_unpack_stack(vm, nr_args, "o", &sheep))
-		return NULL;
+	sheep_t sheep = *sheep_alien_args(vm, nr_args);
 
 	if (sheep_test(sheep))
 		return &sheep_false;
@@ -84,7 +74,7 @@ void sheep_bool_builtins(struct sheep_vm *vm)
 	sheep_vm_variable(vm, "true", &sheep_true);
 	sheep_vm_variable(vm, "false", &sheep_false);
 
-	sheep_vm_function(vm, "=", builtin_equal);
-	sheep_vm_function(vm, "bool", builtin_bool);
-	sheep_vm_function(vm, "not", builtin_not);
+	sheep_vm_operator(vm, "=", builtin_equal, "oo", SHEEP_EQ);
+	sheep_vm_function_sig(vm, "bool", builtin_bool, "o");
+	sheep_vm_function_sig(vm, "not", builtin_not, "o");
 }
@@ -7,7 +7,9 @@
 #include <sheep/foreign.h>
 #include <sheep/object.h>
 #include <sheep/string.h>
+#include <sheep/eval.h>
 #include <sheep/vm.h>
+#include <stdlib.h>
 #include <stdio.h>
 
 #include <sheep/code.h>
@@ -24,11 +26,282 @@ void sheep_code_label(struct sheep_code *code, unsigned long jump)
 	code->labels.items[jump] = (void *)offset;
 }
 
+static int branch(enum sheep_opcode op)
+{
+	return op == SHEEP_BRT || op == SHEEP_BRF || op == SHEEP_BR ||
+		op == SHEEP_BRF_DROP;
+}
+
+static int cached(enum sheep_opcode op)
+{
+	return op == SHEEP_HASH || op == SHEEP_SET_HASH;
+}
+
+/* Operand stack depth change of an instruction */
+static int stack_effect(enum sheep_opcode op, unsigned int arg)
+{
+	switch (op) {
+	case SHEEP_DUP:
+	case SHEEP_LOCAL:
+	case SHEEP_FOREIGN:
+	case SHEEP_GLOBAL:
+	case SHEEP_CLOSURE:
+	case SHEEP_LOAD:
+		return 1;
+	case SHEEP_DROP:
+	case SHEEP_SET_LOCAL:
+	case SHEEP_SET_FOREIGN:
+	case SHEEP_SET_GLOBAL:
+		return -1;
+	case SHEEP_SET_HASH:
+		return -2;
+	case SHEEP_ADD:
+	case SHEEP_SUB:
+	case SHEEP_MUL:
+	case SHEEP_LT:
+	case SHEEP_LE:
+	case SHEEP_GT:
+	case SHEEP_GE:
+	case SHEEP_EQ:
+		/* Both operands are replaced by the result */
+		return -1;
+	case SHEEP_CALL:
+	case SHEEP_TAILCALL:
+		/* Callee and arguments are replaced by the result */
+		return -(int)arg;
+	case SHEEP_CALL_GLOBAL:
+	case SHEEP_TAILCALL_GLOBAL:
+		return 1 - (int)(arg >> SHEEP_OPERAND_BITS);
+	case SHEEP_LOCAL_LOCAL:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Find the deepest the operand stack gets.  Branches only go
+ * forward, so every target's depth is known by the time it is
+ * reached, be it through a branch or by falling through.
+ */
+static unsigned int max_stack(struct sheep_code *code)
+{
+	unsigned long offset, nr = code->code.nr_items;
+	int depth = 0, max = 0, *depths;
+	int reachable = 1;
+
+	depths = sheep_malloc(nr * sizeof(int));
+	for (offset = 0; offset < nr; offset++)
+		depths[offset] = -1;
+
+	for (offset = 0; offset < nr; offset++) {
+		enum sheep_opcode op;
+		unsigned int arg;
+
+		sheep_decode((unsigned long)code->code.items[offset],
+			&op, &arg);
+
+		if (!reachable)
+			depth = depths[offset] < 0 ? 0 : depths[offset];
+		else if (depths[offset] > depth)
+			depth = depths[offset];
+		reachable = 1;
+
+		switch (op) {
+		case SHEEP_BR:
+			reachable = 0;
+			/* fall through */
+		case SHEEP_BRT:
+		case SHEEP_BRF:
+			if (depths[offset + arg] < depth)
+				depths[offset + arg] = depth;
+			break;
+		case SHEEP_BRF_DROP:
+			if (depths[offset + arg] < depth)
+				depths[offset + arg] = depth;
+			depth--;
+			break;
+		case SHEEP_RET:
+			reachable = 0;
+			break;
+		default:
+			depth += stack_effect(op, arg);
+			if (depth > max)
+				max = depth;
+		}
+	}
+	sheep_free(depths);
+	return max;
+}
+
+#ifdef SHEEP_THREADED
+/*
+ * Translate the instructions into pairs of handler address and
+ * operand, branch offsets into the address of the target pair and
+ * inline cache indices into the address of the cache.
+ */
+static void thread_code(struct sheep_code *code)
+{
+	const void *const *handlers = sheep_eval_handlers();
+	unsigned long offset, *threaded;
+
+	threaded = sheep_malloc(code->code.nr_items * 2 * sizeof(long));
+	for (offset = 0; offset < code->code.nr_items; offset++) {
+		unsigned long *insn = threaded + offset * 2;
+		enum sheep_opcode op;
+		unsigned int arg;
+
+		sheep_decode((unsigned long)code->code.items[offset],
+			&op, &arg);
+		insn[0] = (unsigned long)handlers[op];
+		if (branch(op))
+			insn[1] = (unsigned long)(insn + arg * 2);
+		else if (cached(op))
+			insn[1] = (unsigned long)(code->caches + arg);
+		else
+			insn[1] = arg;
+	}
+	code->threaded = threaded;
+}
+#endif
+
+/* Pack two operands into one, if they fit */
+static int pack(unsigned int a, unsigned int b, unsigned int *arg)
+{
+	if (a > SHEEP_OPERAND_MASK || b > SHEEP_OPERAND_MASK)
+		return 0;
+	*arg = a | (b << SHEEP_OPERAND_BITS);
+	/* Narrower with 32-bit longs */
+	return !((unsigned long)*arg >> SHEEP_OPCODE_SHIFT);
+}
+
+/* The superinstruction replacing a pair of instructions, if any */
+static int fusion(enum sheep_opcode op, unsigned int arg,
+		  enum sheep_opcode next, unsigned int next_arg,
+		  unsigned long *insn)
+{
+	unsigned int packed;
+
+	switch (op) {
+	case SHEEP_GLOBAL:
+		if (next == SHEEP_CALL && pack(arg, next_arg, &packed))
+			*insn = sheep_encode(SHEEP_CALL_GLOBAL, packed);
+		else if (next == SHEEP_TAILCALL && pack(arg, next_arg, &packed))
+			*insn = sheep_encode(SHEEP_TAILCALL_GLOBAL, packed);
+		else
+			return 0;
+		return 1;
+	case SHEEP_LOCAL:
+		if (next != SHEEP_LOCAL || !pack(arg, next_arg, &packed))
+			return 0;
+		*insn = sheep_encode(SHEEP_LOCAL_LOCAL, packed);
+		return 1;
+	case SHEEP_BRF:
+		if (next != SHEEP_DROP)
+			return 0;
+		*insn = sheep_encode(SHEEP_BRF_DROP, arg);
+		return 1;
+	case SHEEP_DUP:
+		if (next == SHEEP_SET_LOCAL)
+			*insn = sheep_encode(SHEEP_SET_LOCAL_KEEP, next_arg);
+		else if (next == SHEEP_SET_FOREIGN)
+			*insn = sheep_encode(SHEEP_SET_FOREIGN_KEEP, next_arg);
+		else
+			return 0;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Replace the most frequent instruction pairs by superinstructions,
+ * saving a dispatch each.  Pairs whose second instruction is a
+ * branch target stay apart, branch labels are moved along with the
+ * instructions.
+ */
+static void fuse(struct sheep_code *code)
+{
+	unsigned long offset, nr = code->code.nr_items, nr_fused = 0;
+	unsigned long *map;
+	unsigned char *target;
+
+	target = sheep_zalloc(nr + 1);
+	for (offset = 0; offset < code->labels.nr_items; offset++)
+		target[(unsigned long)code->labels.items[offset]] = 1;
+
+	map = sheep_malloc((nr + 1) * sizeof(unsigned long));
+	for (offset = 0; offset < nr; offset++) {
+		unsigned long insn = (unsigned long)code->code.items[offset];
+		enum sheep_opcode op, next;
+		unsigned int arg, next_arg;
+
+		map[offset] = nr_fused;
+		if (offset + 1 < nr && !target[offset + 1]) {
+			sheep_decode(insn, &op, &arg);
+			sheep_decode((unsigned long)code->code.items[offset + 1],
+				&next, &next_arg);
+			if (fusion(op, arg, next, next_arg, &insn))
+				map[++offset] = nr_fused;
+		}
+		code->code.items[nr_fused++] = (void *)insn;
+	}
+	map[nr] = nr_fused;
+	code->code.nr_items = nr_fused;
+
+	for (offset = 0; offset < code->labels.nr_items; offset++) {
+		unsigned long label = (unsigned long)code->labels.items[offset];
+
+		code->labels.items[offset] = (void *)map[label];
+	}
+	sheep_free(target);
+	sheep_free(map);
+}
+
+/*
+ * Give every HASH and SET_HASH instruction an inline cache of its
+ * own, the key slot moves from the operand into the cache.
+ */
+static void setup_caches(struct sheep_code *code)
+{
+	unsigned long offset, nr = 0;
+	enum sheep_opcode op;
+	unsigned int arg;
+
+	for (offset = 0; offset < code->code.nr_items; offset++) {
+		sheep_decode((unsigned long)code->code.items[offset],
+			&op, &arg);
+		nr += cached(op);
+	}
+	if (!nr)
+		return;
+
+	code->caches = sheep_zalloc(nr * sizeof(struct sheep_hash_cache));
+	for (nr = offset = 0; offset < code->code.nr_items; offset++) {
+		sheep_decode((unsigned long)code->code.items[offset],
+			&op, &arg);
+		if (!cached(op))
+			continue;
+		code->caches[nr].key = arg;
+		code->code.items[offset] = (void *)sheep_encode(op, nr++);
+	}
+}
+
+/**
+ * sheep_code_finalize - make code ready for execution
+ * @code: code, complete but for the final return
+ *
+ * Fuses frequent instruction pairs, resolves branch labels to
+ * relative offsets, sets up the inline caches, determines the
+ * operand stack space the code needs and builds the threaded code
+ * the evaluator runs, when enabled.
+ */
 void sheep_code_finalize(struct sheep_code *code)
 {
 	unsigned long offset;
 
 	sheep_emit(code, SHEEP_RET, 0);
+	fuse(code);
 	for (offset = 0; offset < code->code.nr_items; offset++) {
 		unsigned long label, insn;
 		enum sheep_opcode op;
@@ -37,7 +310,7 @@ void sheep_code_finalize(struct sheep_code *code)
 		insn = (unsigned long)code->code.items[offset];
 		sheep_decode(insn, &op, &arg);
 
-		if (op != SHEEP_BRT && op != SHEEP_BRF && op != SHEEP_BR)
+		if (!branch(op))
 			continue;
 
 		label = (unsigned long)code->labels.items[arg];
@@ -45,6 +318,14 @@ void sheep_code_finalize(struct sheep_code *code)
 
 		code->code.items[offset] = (void *)insn;
 	}
+	setup_caches(code);
+	code->max_stack = max_stack(code);
+#ifdef SHEEP_THREADED
+	thread_code(code);
+#endif
+#ifdef SHEEP_COUNTS
+	code->counts = sheep_zalloc(code->code.nr_items * sizeof(long));
+#endif
 }
 
 static const char *opnames[] = {
@@ -52,9 +333,27 @@ static const char *opnames[] = {
 	"GLOBAL", "SET_GLOBAL", "HASH", "SET_HASH",
 	"CLOSURE", "CALL", "TAILCALL", "RET",
 	"BRT", "BRF", "BR",
-	"LOAD",
+	"LOAD", "ARENA", "LEAVE",
+	"CALL_GLOBAL", "TAILCALL_GLOBAL", "LOCAL_LOCAL",
+	"BRF_DROP", "SET_LOCAL_KEEP", "SET_FOREIGN_KEEP",
+	"ADD", "SUB", "MUL", "LT", "LE", "GT", "GE", "EQ",
 };
 
+static int packed(enum sheep_opcode op)
+{
+	return op == SHEEP_CALL_GLOBAL || op == SHEEP_TAILCALL_GLOBAL ||
+		op == SHEEP_LOCAL_LOCAL;
+}
+
+static void print_insn(enum sheep_opcode op, unsigned int arg)
+{
+	if (packed(op))
+		printf("  %-16s %5u %5u", opnames[op],
+		       arg & SHEEP_OPERAND_MASK, arg >> SHEEP_OPERAND_BITS);
+	else
+		printf("  %-16s %5u", opnames[op], arg);
+}
+
 void sheep_code_dump(struct sheep_vm *vm,
 		     struct sheep_function *function,
 		     unsigned long basep,
@@ -64,7 +363,7 @@ void sheep_code_dump(struct sheep_vm *vm,
 	sheep_t sheep;
 	char *str;
 
-	printf("  %-10s %5u ", opnames[op], arg);
+	print_insn(op, arg);
 
 	switch (op) {
 	case SHEEP_LOCAL:
@@ -79,11 +378,23 @@ void sheep_code_dump(struct sheep_vm *vm,
 		break;
 	case SHEEP_GLOBAL:
 	case SHEEP_CLOSURE:
+	case SHEEP_ADD:
+	case SHEEP_SUB:
+	case SHEEP_MUL:
+	case SHEEP_LT:
+	case SHEEP_LE:
+	case SHEEP_GT:
+	case SHEEP_GE:
+	case SHEEP_EQ:
 		sheep = vm->globals.items[arg];
 		break;
+	case SHEEP_CALL_GLOBAL:
+	case SHEEP_TAILCALL_GLOBAL:
+		sheep = vm->globals.items[arg & SHEEP_OPERAND_MASK];
+		break;
 	case SHEEP_HASH:
 	case SHEEP_SET_HASH:
-		printf("; %s\n", vm->keys[arg]);
+		printf(" ; %s\n", vm->keys[function->code.caches[arg].key]);
 		return;
 	default:
 		puts("");
@@ -91,10 +402,14 @@ void sheep_code_dump(struct sheep_vm *vm,
 	}
 
 	str = sheep_repr(sheep);
-	printf("; %s\n", str);
+	printf(" ; %s\n", str);
 	sheep_free(str);
 }
 
+/*
+ * With instruction counters, every instruction is preceded by the
+ * number of times it was executed.
+ */
 void sheep_code_disassemble(struct sheep_code *code)
 {
 	unsigned long *codep = (unsigned long *)code->code.items;
@@ -103,7 +418,85 @@ void sheep_code_disassemble(struct sheep_code *code)
 
 	do {
 		sheep_decode(*codep, &op, &arg);
-		printf("  %-12s %5u\n", opnames[op], arg);
+#ifdef SHEEP_COUNTS
+		printf("%12lu", code->counts[codep -
+				(unsigned long *)code->code.items]);
+#endif
+		print_insn(op, arg);
+		puts("");
 		codep++;
 	} while (op != SHEEP_RET);
 }
+
+#ifdef SHEEP_COUNTS
+/* Most frequent pairs printed */
+#define HISTOGRAM_PAIRS		32
+
+struct histogram_entry {
+	unsigned long count;
+	enum sheep_opcode op;
+	enum sheep_opcode next;
+};
+
+static int histogram_cmp(const void *a, const void *b)
+{
+	const struct histogram_entry *ea = a, *eb = b;
+
+	if (ea->count != eb->count)
+		return ea->count < eb->count ? 1 : -1;
+	if (ea->op != eb->op)
+		return ea->op < eb->op ? -1 : 1;
+	return ea->next < eb->next ? -1 : ea->next > eb->next;
+}
+
+/**
+ * sheep_code_histogram - print the instruction execution counts
+ * @counts: the counters
+ *
+ * Prints the executions per opcode, and those of the most frequent
+ * pairs of neighbouring instructions, in percent of all executed
+ * instructions.
+ */
+void sheep_code_histogram(struct sheep_insn_counts *counts)
+{
+	struct histogram_entry entries[SHEEP_NR_OPCODES * SHEEP_NR_OPCODES];
+	unsigned long total = 0, nr = 0, i;
+	enum sheep_opcode op, next;
+
+	for (op = 0; op < SHEEP_NR_OPCODES; op++) {
+		if (!counts->ops[op])
+			continue;
+		entries[nr].count = counts->ops[op];
+		entries[nr].op = op;
+		entries[nr].next = 0;
+		total += counts->ops[op];
+		nr++;
+	}
+	if (!total)
+		return;
+	qsort(entries, nr, sizeof(*entries), histogram_cmp);
+
+	fprintf(stderr, "%-33s %12s %7s\n", "instruction", "count", "%");
+	for (i = 0; i < nr; i++)
+		fprintf(stderr, "%-33s %12lu %7.3f\n", opnames[entries[i].op],
+			entries[i].count, entries[i].count * 100.0 / total);
+
+	nr = 0;
+	for (op = 0; op < SHEEP_NR_OPCODES; op++)
+		for (next = 0; next < SHEEP_NR_OPCODES; next++) {
+			if (!counts->pairs[op][next])
+				continue;
+			entries[nr].count = counts->pairs[op][next];
+			entries[nr].op = op;
+			entries[nr].next = next;
+			nr++;
+		}
+	qsort(entries, nr, sizeof(*entries), histogram_cmp);
+
+	fprintf(stderr, "\n%-33s %12s %7s\n", "instruction pair", "count", "%");
+	for (i = 0; i < nr && i < HISTOGRAM_PAIRS; i++)
+		fprintf(stderr, "%-16s %-16s %12lu %7.3f\n",
+			opnames[entries[i].op], opnames[entries[i].next],
+			entries[i].count, entries[i].count * 100.0 / total);
+}
+#endif
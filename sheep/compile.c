@@ -15,6 +15,7 @@
 #include <sheep/map.h>
 #include <sheep/gc.h>
 #include <sheep/vm.h>
+#include <string.h>
 
 #include <sheep/compile.h>
 
@@ -22,7 +23,7 @@ sheep_t __sheep_compile(struct sheep_vm *vm,
 			struct sheep_module *module,
 			struct sheep_expr *expr)
 {
-	struct sheep_function *function;
+	struct sheep_function function;
 	struct sheep_compile compile = {
 		.vm = vm,
 		.module = module,
@@ -31,23 +32,28 @@ sheep_t __sheep_compile(struct sheep_vm *vm,
 	struct sheep_context context = {
 		.env = &module->env,
 	};
+	sheep_t sheep;
 	int err;
 
 	sheep_protect(vm, expr->object);
 
-	function = sheep_zalloc(sizeof(struct sheep_function));
-	err = sheep_compile_object(&compile, function, &context, expr->object);
+	memset(&function, 0, sizeof(struct sheep_function));
+	function.line = (unsigned long)expr->lines.items[0];
+	err = sheep_compile_object(&compile, &function, &context, expr->object);
 	if (err) {
-		sheep_code_exit(&function->code);
-		sheep_free(function);
+		sheep_code_exit(&function.code);
 
 		sheep_unprotect(vm, expr->object);
 		return NULL;
 	}
-	sheep_code_finalize(&function->code);
+	sheep_code_finalize(&function.code);
 
 	sheep_unprotect(vm, expr->object);
-	return sheep_make_object(vm, &sheep_function_type, function);
+
+	sheep = sheep_make_object(vm, &sheep_function_type,
+				sizeof(struct sheep_function));
+	*sheep_function(sheep) = function;
+	return sheep;
 }
 
 int sheep_compile_constant(struct sheep_compile *compile,
@@ -173,6 +179,37 @@ int sheep_compile_set(struct sheep_compile *compile,
 	return compile_name(compile, function, context, sheep, 1);
 }
 
+/*
+ * Replace a call to a builtin operator by its instruction, see
+ * sheep_vm_operator().  Returns whether it did.
+ */
+static int compile_operator(struct sheep_compile *compile,
+			    struct sheep_function *function,
+			    struct sheep_context *context,
+			    sheep_t sheep)
+{
+	struct sheep_vm *vm = compile->vm;
+	unsigned int dist, slot, i;
+	struct sheep_name *name;
+
+	if (sheep_type(sheep) != &sheep_name_type)
+		return 0;
+	name = sheep_name(sheep);
+	if (name->nr_parts != 1)
+		return 0;
+	if (lookup_env(compile, context, *name->parts, &dist, &slot) !=
+	    ENV_GLOBAL)
+		return 0;
+
+	for (i = 0; i < SHEEP_NR_OPERATORS; i++) {
+		if (vm->globals.items[slot] != vm->operators[i])
+			continue;
+		sheep_emit(&function->code, SHEEP_ADD + i, slot);
+		return 1;
+	}
+	return 0;
+}
+
 static int compile_call(struct sheep_compile *compile,
 			struct sheep_function *function,
 			struct sheep_context *context,
@@ -196,6 +233,12 @@ static int compile_call(struct sheep_compile *compile,
 	tail = context->flags & SHEEP_CONTEXT_TAILFORM;
 	context->flags &= ~SHEEP_CONTEXT_TAILFORM;
 
+	if (nargs == 2 && compile_operator(compile, function, context,
+					   form->head)) {
+		ret = 0;
+		goto out;
+	}
+
 	if (sheep_compile_object(compile, function, context, form->head))
 		goto out;
 
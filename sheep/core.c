@@ -4,6 +4,7 @@
  * Copyright (c) 2009 Johannes Weiner <hannes@cmpxchg.org>
  */
 #include <sheep/function.h>
+#include <sheep/profile.h>
 #include <sheep/foreign.h>
 #include <sheep/compile.h>
 #include <sheep/module.h>
@@ -231,6 +232,7 @@ static int compile_function(struct sheep_compile *compile,
 
 	sheep = sheep_make_function(compile->vm, name);
 	childfun = sheep_data(sheep);
+	childfun->line = sheep_parser_line(compile, args->head);
 
 	while (parms->head) {
 		struct sheep_list *rest;
@@ -458,6 +460,37 @@ out:
 	return ret;
 }
 
+/* (with-arena expr*) */
+static int compile_with_arena(struct sheep_compile *compile,
+			      struct sheep_function *function,
+			      struct sheep_context *context,
+			      struct sheep_list *args)
+{
+	SHEEP_DEFINE_MAP(env);
+	struct sheep_context block = {
+		.env = &env,
+		.parent = context,
+	};
+	unsigned int locals;
+	int ret;
+
+	if (sheep_parse(compile, args, "R", &args))
+		return -1;
+
+	/* The region is left after the body, no tail calls out of it */
+	context->flags &= ~SHEEP_CONTEXT_TAILFORM;
+
+	/* The locals of the body are not referenced after it */
+	locals = function->nr_locals;
+
+	sheep_emit(&function->code, SHEEP_ARENA, 0);
+	ret = do_compile_forms(compile, function, &block, args);
+	sheep_emit(&function->code, SHEEP_LEAVE, locals);
+
+	sheep_map_drain(&env);
+	return ret;
+}
+
 /* (load name) */
 static int compile_load(struct sheep_compile *compile,
 			struct sheep_function *function,
@@ -477,6 +510,31 @@ static int compile_load(struct sheep_compile *compile,
 	return 0;
 }
 
+/* (profile expr) */
+static int compile_profile(struct sheep_compile *compile,
+			   struct sheep_function *function,
+			   struct sheep_context *context,
+			   struct sheep_list *args)
+{
+	struct sheep_profile *profile = &compile->vm->profile;
+	sheep_t expr;
+
+	if (sheep_parse(compile, args, "e", &expr))
+		return -1;
+
+	/* Sampling stops after the expression, no tail calls out of it */
+	context->flags &= ~SHEEP_CONTEXT_TAILFORM;
+
+	sheep_emit(&function->code, SHEEP_GLOBAL, profile->start);
+	sheep_emit(&function->code, SHEEP_CALL, 0);
+	sheep_emit(&function->code, SHEEP_DROP, 0);
+	if (sheep_compile_object(compile, function, context, expr))
+		return -1;
+	sheep_emit(&function->code, SHEEP_GLOBAL, profile->stop);
+	sheep_emit(&function->code, SHEEP_CALL, 1);
+	return 0;
+}
+
 void sheep_core_init(struct sheep_vm *vm)
 {
 	sheep_map_set(&vm->specials, "quote", compile_quote);
@@ -490,6 +548,8 @@ void sheep_core_init(struct sheep_vm *vm)
 	sheep_map_set(&vm->specials, "if", compile_if);
 	sheep_map_set(&vm->specials, "set", compile_set);
 	sheep_map_set(&vm->specials, "load", compile_load);
+	sheep_map_set(&vm->specials, "with-arena", compile_with_arena);
+	sheep_map_set(&vm->specials, "profile", compile_profile);
 }
 
 void sheep_core_exit(struct sheep_vm *vm)
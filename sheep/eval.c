@@ -4,6 +4,7 @@
  * Copyright (c) 2009 Johannes Weiner <hannes@cmpxchg.org>
  */
 #include <sheep/function.h>
+#include <sheep/profile.h>
 #include <sheep/foreign.h>
 #include <sheep/object.h>
 #include <sheep/string.h>
@@ -22,39 +23,68 @@
 
 #include <sheep/eval.h>
 
+/*
+ * Look up a name in a module or typeobject, and assign it when
+ * @value is given.  The site's cache remembers where the name was
+ * found in the last few modules and typeclasses, which saves the
+ * map lookup on repeated accesses.
+ */
 static sheep_t hash(struct sheep_vm *vm,
 		    sheep_t container,
-		    unsigned int key_slot,
+		    struct sheep_hash_cache *cache,
 		    sheep_t value)
 {
+	sheep_t *slots, object = NULL;
 	const char *key, *obj;
 	struct sheep_map *map;
-	sheep_t *slots;
+	unsigned long index, id;
+	unsigned int i;
 	void *entry;
 
-	key = vm->keys[key_slot];
-
 	if (sheep_type(container) == &sheep_module_type) {
 		struct sheep_module *mod = sheep_data(container);
 
 		slots = (sheep_t *)vm->globals.items;
 		map = &mod->env;
+		id = mod->id;
 	} else if (sheep_type(container) == &sheep_typeobject_type) {
-		struct sheep_typeobject *object = sheep_data(container);
+		struct sheep_typeobject *typeobject = sheep_data(container);
+		struct sheep_typeclass *class = sheep_data(typeobject->class);
 
-		slots = object->values;
-		map = &object->map;
+		slots = typeobject->values;
+		map = &class->map;
+		id = class->id;
+		object = container;
 	} else
 		goto err;
 
-	if (sheep_map_get(map, key, &entry))
-		goto err;
+	for (i = 0; i < SHEEP_HASH_WAYS; i++) {
+		if (cache->ids[i] == id) {
+			index = cache->indices[i];
+			goto found;
+		}
+	}
 
-	if (value)
-		slots[(unsigned long)entry] = value;
+	if (sheep_map_get(map, vm->keys[cache->key], &entry))
+		goto err;
+	index = (unsigned long)entry;
+
+	i = cache->next;
+	cache->ids[i] = id;
+	cache->indices[i] = index;
+	cache->next = (i + 1) % SHEEP_HASH_WAYS;
+found:
+	if (value) {
+		if (object) {
+			slots[index] = value;
+			sheep_gc_write(vm, object, value);
+		} else
+			sheep_vm_set_global(vm, index, value);
+	}
 
-	return slots[(unsigned long)entry];
+	return slots[index];
 err:
+	key = vm->keys[cache->key];
 	obj = sheep_repr(container);
 	sheep_error(vm, "can not find `%s' in `%s'", key, obj);
 	sheep_free(obj);
@@ -106,229 +136,495 @@ static void splice_arguments(struct sheep_vm *vm,
 	vm->stack.nr_items = basep + nr_args;
 }
 
+/*
+ * Set up the frame of a function whose arguments are on top of the
+ * stack: clear the other locals and reserve room for the deepest
+ * the operand stack gets, so the evaluator can push unchecked.
+ */
 static unsigned long finalize_frame(struct sheep_vm *vm,
 				    struct sheep_function *function)
 {
 	unsigned int nr;
 
 	nr = function->nr_locals - function->nr_parms;
-	if (nr)
-		sheep_vector_grow(&vm->stack, nr);
+	sheep_vector_reserve(&vm->stack, nr + function->code.max_stack);
+	while (nr--)
+		vm->stack.items[vm->stack.nr_items++] = NULL;
 	return vm->stack.nr_items - function->nr_locals;
 }
 
 static unsigned long *function_codep(struct sheep_function *function)
 {
+#ifdef SHEEP_THREADED
+	return function->code.threaded;
+#else
 	return (unsigned long *)function->code.code.items;
+#endif
 }
 
-sheep_t sheep_eval(struct sheep_vm *vm, sheep_t function, int inner_call)
+#ifdef SHEEP_COUNTS
+#ifdef SHEEP_THREADED
+#define INSN_WORDS	2
+#else
+#define INSN_WORDS	1
+#endif
+
+/*
+ * Count the instruction about to be executed, and the pair it forms
+ * with the previous one if that was its neighbour in the code.
+ */
+static void count(struct sheep_vm *vm, struct sheep_function *function,
+		  unsigned long *codep)
+{
+	struct sheep_insn_counts *counts = &vm->counts;
+	unsigned long index;
+	enum sheep_opcode op;
+	unsigned int arg;
+
+	index = (codep - function_codep(function)) / INSN_WORDS;
+	sheep_decode((unsigned long)function->code.code.items[index],
+		     &op, &arg);
+	function->code.counts[index]++;
+	counts->ops[op]++;
+	if (counts->lastp && codep == counts->lastp + INSN_WORDS)
+		counts->pairs[counts->last][op]++;
+	counts->lastp = codep;
+	counts->last = op;
+}
+
+#define COUNT()		do {						\
+				if (vm->counts.enabled)			\
+					count(vm, current, codep);	\
+			} while (0)
+#else
+#define COUNT()		do { } while (0)
+#endif
+
+/*
+ * With threaded code, every instruction is a pair of the address of
+ * its handler below and the operand, with branch operands resolved
+ * to the address of the target pair and inline cache indices to the
+ * address of the cache.  Otherwise, the encoded instructions are
+ * dispatched through a switch.
+ */
+#ifdef SHEEP_THREADED
+#define INSN(op)	do_##op
+#define DISPATCH()	do {						\
+				COUNT();				\
+				arg = codep[1];				\
+				goto *(void *)codep[0];			\
+			} while (0)
+#define NEXT()		do { codep += 2; DISPATCH(); } while (0)
+#define JUMP()		do { codep = (unsigned long *)arg; DISPATCH(); } while (0)
+#define CACHE()		((struct sheep_hash_cache *)arg)
+#else
+#define INSN(op)	case SHEEP_##op
+#define DISPATCH()	goto dispatch
+#define NEXT()		do { codep++; DISPATCH(); } while (0)
+#define JUMP()		do { codep += arg; DISPATCH(); } while (0)
+#define CACHE()		(&current->code.caches[arg])
+#endif
+
+/*
+ * The stack and frame pointers and the pointer to the next call
+ * frame live in locals.  The stack's item count and the number of
+ * call frames are only updated before calling out into code that
+ * might look at them or collect garbage, and the pointers are
+ * reloaded afterwards, in case the stack or the frames were moved.
+ */
+#define SAVE_SP()	do {						\
+				vm->stack.nr_items = sp -		\
+					(sheep_t *)vm->stack.items;	\
+				vm->nr_frames = fp - vm->frames;	\
+			} while (0)
+#define LOAD_SP()	do {						\
+				sp = (sheep_t *)vm->stack.items +	\
+					vm->stack.nr_items;		\
+				bp = (sheep_t *)vm->stack.items + basep; \
+				fp = vm->frames + vm->nr_frames;	\
+			} while (0)
+
+/* Initial number of call frames */
+#define FRAMES_MIN	256
+
+static struct sheep_frame *grow_frames(struct sheep_vm *vm,
+				       struct sheep_frame *fp)
+{
+	unsigned long nr = fp - vm->frames;
+
+	vm->max_frames = vm->max_frames ? vm->max_frames * 2 : FRAMES_MIN;
+	vm->frames = sheep_realloc(vm->frames,
+				   vm->max_frames * sizeof(struct sheep_frame));
+	return vm->frames + nr;
+}
+
+/*
+ * Operator instructions handle two fixnums inline, as long as the
+ * operator's global still holds the builtin, see sheep_vm_operator().
+ */
+static inline int inline_operator(struct sheep_vm *vm, sheep_t *sp,
+				  unsigned int slot, enum sheep_opcode op)
 {
+	return sheep_is_fixnum(sp[-2]) && sheep_is_fixnum(sp[-1]) &&
+		vm->globals.items[slot] == vm->operators[op - SHEEP_ADD];
+}
+
+#define OPERATOR(op, expr) do {						\
+				long a, b;				\
+									\
+				if (!inline_operator(vm, sp, arg, op))	\
+					goto operator;			\
+				a = sheep_fixnum(sp[-2]);		\
+				b = sheep_fixnum(sp[-1]);		\
+				sp--;					\
+				sp[-1] = (expr);			\
+				NEXT();					\
+			} while (0)
+
+static sheep_t eval(struct sheep_vm *vm, sheep_t function, int inner_call,
+		    const void *const **handlersp)
+{
+#ifdef SHEEP_THREADED
+	static const void *const handlers[] = {
+		[SHEEP_DROP] = &&INSN(DROP),
+		[SHEEP_DUP] = &&INSN(DUP),
+		[SHEEP_LOCAL] = &&INSN(LOCAL),
+		[SHEEP_SET_LOCAL] = &&INSN(SET_LOCAL),
+		[SHEEP_FOREIGN] = &&INSN(FOREIGN),
+		[SHEEP_SET_FOREIGN] = &&INSN(SET_FOREIGN),
+		[SHEEP_GLOBAL] = &&INSN(GLOBAL),
+		[SHEEP_SET_GLOBAL] = &&INSN(SET_GLOBAL),
+		[SHEEP_HASH] = &&INSN(HASH),
+		[SHEEP_SET_HASH] = &&INSN(SET_HASH),
+		[SHEEP_CLOSURE] = &&INSN(CLOSURE),
+		[SHEEP_CALL] = &&INSN(CALL),
+		[SHEEP_TAILCALL] = &&INSN(TAILCALL),
+		[SHEEP_RET] = &&INSN(RET),
+		[SHEEP_BRT] = &&INSN(BRT),
+		[SHEEP_BRF] = &&INSN(BRF),
+		[SHEEP_BR] = &&INSN(BR),
+		[SHEEP_LOAD] = &&INSN(LOAD),
+		[SHEEP_ARENA] = &&INSN(ARENA),
+		[SHEEP_LEAVE] = &&INSN(LEAVE),
+		[SHEEP_CALL_GLOBAL] = &&INSN(CALL_GLOBAL),
+		[SHEEP_TAILCALL_GLOBAL] = &&INSN(TAILCALL_GLOBAL),
+		[SHEEP_LOCAL_LOCAL] = &&INSN(LOCAL_LOCAL),
+		[SHEEP_BRF_DROP] = &&INSN(BRF_DROP),
+		[SHEEP_SET_LOCAL_KEEP] = &&INSN(SET_LOCAL_KEEP),
+		[SHEEP_SET_FOREIGN_KEEP] = &&INSN(SET_FOREIGN_KEEP),
+		[SHEEP_ADD] = &&INSN(ADD),
+		[SHEEP_SUB] = &&INSN(SUB),
+		[SHEEP_MUL] = &&INSN(MUL),
+		[SHEEP_LT] = &&INSN(LT),
+		[SHEEP_LE] = &&INSN(LE),
+		[SHEEP_GT] = &&INSN(GT),
+		[SHEEP_GE] = &&INSN(GE),
+		[SHEEP_EQ] = &&INSN(EQ),
+	};
+	unsigned long arg;
+#else
+	enum sheep_opcode op;
+	unsigned int arg;
+#endif
+	struct sheep_indirect *indirect;
 	struct sheep_function *current;
 	unsigned long basep, *codep;
 	unsigned int nesting = 0;
+	struct sheep_frame *fp;
 	sheep_t problem = NULL;
+	sheep_t *sp, *bp;
+	sheep_t tmp;
 
-	sheep_protect(vm, function);
+#ifdef SHEEP_THREADED
+	if (handlersp) {
+		*handlersp = handlers;
+		return NULL;
+	}
+#endif
 
 	current = sheep_function(function);
 	codep = function_codep(current);
 	basep = finalize_frame(vm, current);
-
-	for (;;) {
-		struct sheep_indirect *indirect;
-		enum sheep_opcode op;
-		unsigned int arg;
-		sheep_t tmp;
-		int done;
-
-		sheep_decode(*codep, &op, &arg);
-		//sheep_code_dump(vm, current, basep, op, arg);
-
-		switch (op) {
-		case SHEEP_DROP:
-			sheep_vector_pop(&vm->stack);
-			break;
-		case SHEEP_DUP:
-			tmp = vm->stack.items[vm->stack.nr_items - 1];
-			sheep_vector_push(&vm->stack, tmp);
-			break;
-		case SHEEP_LOCAL:
-			tmp = vm->stack.items[basep + arg];
-			sheep_vector_push(&vm->stack, tmp);
-			break;
-		case SHEEP_SET_LOCAL:
-			tmp = sheep_vector_pop(&vm->stack);
-			vm->stack.items[basep + arg] = tmp;
-			break;
-		case SHEEP_FOREIGN:
-			indirect = current->foreign->items[arg];
-			if (indirect->count < 0)
-				tmp = indirect->value.closed;
-			else {
-				unsigned long index;
-
-				index = indirect->value.live.index;
-				tmp = vm->stack.items[index];
-			}
-			sheep_vector_push(&vm->stack, tmp);
-			break;
-		case SHEEP_SET_FOREIGN:
-			tmp = sheep_vector_pop(&vm->stack);
-			indirect = current->foreign->items[arg];
-			if (indirect->count < 0)
-				indirect->value.closed = tmp;
-			else {
-				unsigned long index;
-
-				index = indirect->value.live.index;
-				vm->stack.items[index] = tmp;
-			}
-			break;
-		case SHEEP_GLOBAL:
-			tmp = vm->globals.items[arg];
-			sheep_vector_push(&vm->stack, tmp);
-			break;
-		case SHEEP_SET_GLOBAL:
-			tmp = sheep_vector_pop(&vm->stack);
-			vm->globals.items[arg] = tmp;
-			break;
-		case SHEEP_HASH:
-			tmp = sheep_vector_pop(&vm->stack);
-			tmp = hash(vm, tmp, arg, NULL);
-			if (!tmp)
-				goto err;
-			sheep_vector_push(&vm->stack, tmp);
-			break;
-		case SHEEP_SET_HASH:
-			tmp = sheep_vector_pop(&vm->stack);
-			if (!hash(vm, tmp, arg, sheep_vector_pop(&vm->stack)))
-				goto err;
-			break;
-		case SHEEP_CLOSURE:
-			tmp = vm->globals.items[arg];
-			tmp = closure(vm, basep, current, tmp);
-			sheep_vector_push(&vm->stack, tmp);
-			break;
-		case SHEEP_TAILCALL:
-			tmp = sheep_vector_pop(&vm->stack);
-
-			done = precall(vm, tmp, arg, &tmp);
-			switch (done) {
-			case SHEEP_CALL_FAIL:
-				problem = tmp;
-				goto err;
-			case SHEEP_CALL_DONE:
-				sheep_vector_push(&vm->stack, tmp);
-				break;
-			case SHEEP_CALL_EVAL:
-				sheep_foreign_save(vm, basep);
-				splice_arguments(vm, basep, arg);
-
-				sheep_unprotect(vm, function);
-				function = tmp;
-				sheep_protect(vm, function);
-
-				current = sheep_function(function);
-				finalize_frame(vm, current);
-				codep = function_codep(current);
-				continue;
-			}
+	LOAD_SP();
+
+#ifdef SHEEP_THREADED
+	DISPATCH();
+#else
+dispatch:
+	COUNT();
+	sheep_decode(*codep, &op, &arg);
+	//SAVE_SP(); sheep_code_dump(vm, current, basep, op, arg);
+
+	switch (op) {
+#endif
+	INSN(DROP):
+		sp--;
+		NEXT();
+	INSN(DUP):
+		*sp = sp[-1];
+		sp++;
+		NEXT();
+	INSN(LOCAL):
+		*sp++ = bp[arg];
+		NEXT();
+	INSN(SET_LOCAL):
+		bp[arg] = *--sp;
+		NEXT();
+	INSN(SET_LOCAL_KEEP):
+		bp[arg] = sp[-1];
+		NEXT();
+	INSN(LOCAL_LOCAL):
+		*sp++ = bp[arg & SHEEP_OPERAND_MASK];
+		*sp++ = bp[arg >> SHEEP_OPERAND_BITS];
+		NEXT();
+	INSN(FOREIGN):
+		indirect = current->foreign->items[arg];
+		if (indirect->count < 0)
+			tmp = indirect->value.closed;
+		else {
+			unsigned long index;
+
+			index = indirect->value.live.index;
+			tmp = vm->stack.items[index];
+		}
+		*sp++ = tmp;
+		NEXT();
+	INSN(SET_FOREIGN_KEEP):
+		tmp = sp[-1];
+		goto set_foreign;
+	INSN(SET_FOREIGN):
+		tmp = *--sp;
+	set_foreign:
+		indirect = current->foreign->items[arg];
+		if (indirect->count < 0) {
+			indirect->value.closed = tmp;
+			/* Found through the closure by regions */
+			sheep_gc_arena_write(vm, function, tmp);
+			sheep_gc_write(vm, NULL, tmp);
+		} else {
+			unsigned long index;
+
+			index = indirect->value.live.index;
+			vm->stack.items[index] = tmp;
+		}
+		NEXT();
+	INSN(GLOBAL):
+		*sp++ = vm->globals.items[arg];
+		NEXT();
+	INSN(SET_GLOBAL):
+		sheep_vm_set_global(vm, arg, *--sp);
+		NEXT();
+	/* hash() neither allocates objects nor looks at the stack */
+	INSN(HASH):
+		tmp = hash(vm, sp[-1], CACHE(), NULL);
+		if (!tmp)
+			goto fail;
+		sp[-1] = tmp;
+		NEXT();
+	INSN(SET_HASH):
+		sp -= 2;
+		if (!hash(vm, sp[1], CACHE(), sp[0]))
+			goto fail;
+		NEXT();
+	INSN(CLOSURE):
+		SAVE_SP();
+		tmp = closure(vm, basep, current, vm->globals.items[arg]);
+		*sp++ = tmp;
+		NEXT();
+	INSN(TAILCALL_GLOBAL):
+		tmp = vm->globals.items[arg & SHEEP_OPERAND_MASK];
+		arg >>= SHEEP_OPERAND_BITS;
+		goto tailcall;
+	INSN(TAILCALL):
+		tmp = *--sp;
+	tailcall:
+		SAVE_SP();
+		if (vm->profile.pending)
+			sheep_profile_sample(vm, function);
+		switch (precall(vm, tmp, arg, &tmp)) {
+		case SHEEP_CALL_FAIL:
+			problem = tmp;
+			goto err;
+		case SHEEP_CALL_DONE:
+			LOAD_SP();
+			*sp++ = tmp;
+			NEXT();
+		case SHEEP_CALL_EVAL:
 			break;
-		case SHEEP_CALL:
-			tmp = sheep_vector_pop(&vm->stack);
-
-			done = precall(vm, tmp, arg, &tmp);
-			switch (done) {
-			case SHEEP_CALL_FAIL:
-				problem = tmp;
-				goto err;
-			case SHEEP_CALL_DONE:
-				sheep_vector_push(&vm->stack, tmp);
-				break;
-			case SHEEP_CALL_EVAL:
-				sheep_vector_push(&vm->calls, codep);
-				sheep_vector_push(&vm->calls, (void *)basep);
-				sheep_vector_push(&vm->calls, function);
-
-				sheep_unprotect(vm, function);
-				function = tmp;
-				sheep_protect(vm, function);
-
-				current = sheep_function(function);
-				basep = finalize_frame(vm, current);
-				codep = function_codep(current);
-
-				nesting++;
-				continue;
-			}
+		}
+		sheep_foreign_save(vm, basep);
+		splice_arguments(vm, basep, arg);
+
+		function = tmp;
+
+		current = sheep_function(function);
+		finalize_frame(vm, current);
+		codep = function_codep(current);
+		LOAD_SP();
+		DISPATCH();
+	INSN(CALL_GLOBAL):
+		tmp = vm->globals.items[arg & SHEEP_OPERAND_MASK];
+		arg >>= SHEEP_OPERAND_BITS;
+		goto call;
+	INSN(CALL):
+		tmp = *--sp;
+	call:
+		SAVE_SP();
+		if (vm->profile.pending)
+			sheep_profile_sample(vm, function);
+		switch (precall(vm, tmp, arg, &tmp)) {
+		case SHEEP_CALL_FAIL:
+			problem = tmp;
+			goto err;
+		case SHEEP_CALL_DONE:
+			LOAD_SP();
+			*sp++ = tmp;
+			NEXT();
+		case SHEEP_CALL_EVAL:
 			break;
-		case SHEEP_RET:
-			sheep_bug_on(vm->stack.nr_items -
-				basep - current->nr_locals != 1);
-
-			sheep_foreign_save(vm, basep);
-
-			if (current->nr_locals) {
-				vm->stack.items[basep] =
-					vm->stack.items[basep +
-							current->nr_locals];
-				vm->stack.nr_items = basep + 1;
-			}
-
-			sheep_unprotect(vm, function);
+		}
+		if (fp == vm->frames + vm->max_frames)
+			fp = grow_frames(vm, fp);
+		fp->codep = codep;
+		fp->basep = basep;
+		fp->function = function;
+
+		function = tmp;
+
+		current = sheep_function(function);
+		basep = finalize_frame(vm, current);
+		codep = function_codep(current);
+		/* Reloads the frame just filled in */
+		LOAD_SP();
+		fp++;
+
+		nesting++;
+		DISPATCH();
+	INSN(RET):
+		if (vm->profile.pending) {
+			SAVE_SP();
+			sheep_profile_sample(vm, function);
+		}
+		sheep_bug_on(sp - bp - current->nr_locals != 1);
 
-			if (!nesting--)
-				goto out;
+		sheep_foreign_save(vm, basep);
 
-			function = sheep_vector_pop(&vm->calls);
-			sheep_protect(vm, function);
+		*bp = sp[-1];
+		sp = bp + 1;
 
-			current = sheep_function(function);
-			basep = (unsigned long)sheep_vector_pop(&vm->calls);
-			codep = sheep_vector_pop(&vm->calls);
-			break;
-		case SHEEP_BRT:
-			tmp = vm->stack.items[vm->stack.nr_items - 1];
-			if (!sheep_test(tmp))
-				break;
-			codep += arg;
-			continue;
-		case SHEEP_BRF:
-			tmp = vm->stack.items[vm->stack.nr_items - 1];
-			if (sheep_test(tmp))
-				break;
-		case SHEEP_BR:
-			codep += arg;
-			continue;
-		case SHEEP_LOAD:
-			tmp = sheep_module_load(vm, vm->keys[arg]);
-			if (!tmp)
-				goto err;
-			sheep_vector_push(&vm->stack, tmp);
-			break;
-		default:
-			abort();
+		if (!nesting--) {
+			SAVE_SP();
+			goto out;
 		}
-		codep++;
+
+		fp--;
+		function = fp->function;
+		current = sheep_function(function);
+		basep = fp->basep;
+		codep = fp->codep;
+		bp = (sheep_t *)vm->stack.items + basep;
+		NEXT();
+	INSN(BRT):
+		if (!sheep_test(sp[-1]))
+			NEXT();
+		JUMP();
+	INSN(BRF):
+		if (sheep_test(sp[-1]))
+			NEXT();
+		JUMP();
+	INSN(BRF_DROP):
+		if (!sheep_test(sp[-1]))
+			JUMP();
+		sp--;
+		NEXT();
+	INSN(BR):
+		JUMP();
+	INSN(ADD):
+		OPERATOR(SHEEP_ADD, sheep_make_number(vm, a + b));
+	INSN(SUB):
+		OPERATOR(SHEEP_SUB, sheep_make_number(vm, a - b));
+	INSN(MUL):
+		OPERATOR(SHEEP_MUL, sheep_make_number(vm, a * b));
+	INSN(LT):
+		OPERATOR(SHEEP_LT, a < b ? &sheep_true : &sheep_false);
+	INSN(LE):
+		OPERATOR(SHEEP_LE, a <= b ? &sheep_true : &sheep_false);
+	INSN(GT):
+		OPERATOR(SHEEP_GT, a > b ? &sheep_true : &sheep_false);
+	INSN(GE):
+		OPERATOR(SHEEP_GE, a >= b ? &sheep_true : &sheep_false);
+	INSN(EQ):
+		OPERATOR(SHEEP_EQ, a == b ? &sheep_true : &sheep_false);
+	operator:
+		/* Not inlined after all, call whatever the global holds */
+		tmp = vm->globals.items[arg];
+		arg = 2;
+		goto call;
+	INSN(LOAD):
+		SAVE_SP();
+		tmp = sheep_module_load(vm, vm->keys[arg]);
+		if (!tmp)
+			goto err;
+		LOAD_SP();
+		*sp++ = tmp;
+		NEXT();
+	INSN(ARENA):
+		sheep_gc_arena_enter(vm);
+		NEXT();
+	INSN(LEAVE):
+		SAVE_SP();
+		sheep_gc_arena_exit(vm, sp[-1], basep + arg);
+		NEXT();
+#ifndef SHEEP_THREADED
+	default:
+		abort();
 	}
+#endif
 out:
 	return sheep_vector_pop(&vm->stack);
+fail:
+	/* Errors that did not call out, the counts are stale */
+	SAVE_SP();
 err:
 	vm->stack.nr_items = 0;
-	vm->calls.nr_items -= 3 * nesting;
+	vm->nr_frames -= nesting;
+
+	/*
+	 * Nothing is left to return into, leave all regions and stop
+	 * the profiles of the forms that did not finish.
+	 */
+	if (!vm->nr_frames) {
+		while (vm->arena.depth)
+			sheep_gc_arena_exit(vm, NULL, 0);
+		sheep_profile_unwind(vm);
+	}
 
 	/*
 	 * If it's an inner call, eg. a SHEEP_TAILCALL inside a SHEEP_CALL, we
 	 * should rely on the upper one doing the reporting, otherwise
 	 * vm->error is lost in sheep_report_error.
 	 */
-	if (!inner_call && !vm->calls.nr_items)
+	if (!inner_call && !vm->nr_frames)
 		sheep_report_error(vm, problem);
-	sheep_unprotect(vm, function);
 	return NULL;
 }
 
+sheep_t sheep_eval(struct sheep_vm *vm, sheep_t function, int inner_call)
+{
+	return eval(vm, function, inner_call, NULL);
+}
+
+#ifdef SHEEP_THREADED
+/* The instruction handlers, indexed by opcode, see sheep_code_finalize() */
+const void *const *sheep_eval_handlers(void)
+{
+	const void *const *handlers;
+
+	eval(NULL, NULL, 0, &handlers);
+	return handlers;
+}
+#endif
+
 static sheep_t call(struct sheep_vm *vm, sheep_t callable, unsigned int nr_args)
 {
 	sheep_t value;
@@ -375,7 +671,7 @@ sheep_t sheep_call(struct sheep_vm *vm,
 
 void sheep_evaluator_exit(struct sheep_vm *vm)
 {
-	sheep_free(vm->calls.items);
+	sheep_free(vm->frames);
 	sheep_free(vm->stack.items);
 	sheep_map_drain(&vm->main.env);
 }
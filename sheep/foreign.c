@@ -86,7 +86,7 @@ static struct sheep_indirect *open_indirect(struct sheep_vm *vm,
 		next = next->value.live.next;
 	}
 
-	new = sheep_malloc(sizeof(struct sheep_indirect));
+	new = sheep_cache_alloc(&vm->cache, sizeof(struct sheep_indirect));
 	new->count = 1;
 	new->value.live.index = index;
 	new->value.live.next = next;
@@ -108,7 +108,12 @@ struct sheep_vector *sheep_foreign_open(struct sheep_vm *vm,
 	struct sheep_vector *indirects;
 	unsigned int i;
 
-	indirects = sheep_zalloc(sizeof(struct sheep_vector));
+	/* Sized exactly, the indirect pointers are never added to later */
+	indirects = sheep_cache_alloc(&vm->cache, sizeof(struct sheep_vector));
+	indirects->items = sheep_cache_alloc(&vm->cache,
+					freevars->nr_items * sizeof(void *));
+	indirects->nr_items = 0;
+	indirects->nr_alloc = freevars->nr_items;
 
 	for (i = 0; i < freevars->nr_items; i++) {
 		struct sheep_indirect *indirect;
@@ -124,7 +129,7 @@ struct sheep_vector *sheep_foreign_open(struct sheep_vm *vm,
 			else
 				indirect->count++;
 		}
-		sheep_vector_push(indirects, indirect);
+		indirects->items[indirects->nr_items++] = indirect;
 	}
 	return indirects;
 }
@@ -144,6 +149,7 @@ void sheep_foreign_save(struct sheep_vm *vm, unsigned long basep)
 
 		indirect->count = -indirect->count;
 		indirect->value.closed = vm->stack.items[index];
+		sheep_gc_write(vm, NULL, indirect->value.closed);
 	}
 }
 
@@ -161,6 +167,21 @@ void sheep_foreign_mark(struct sheep_vector *foreign)
 	}
 }
 
+/* update reachable indirect pointers to moved objects */
+void sheep_foreign_forward(struct sheep_vector *foreign)
+{
+	unsigned int i;
+
+	for (i = 0; i < foreign->nr_items; i++) {
+		struct sheep_indirect *indirect;
+
+		indirect = foreign->items[i];
+		if (indirect->count < 0)
+			indirect->value.closed =
+				sheep_forward(indirect->value.closed);
+	}
+}
+
 static void unlink_live(struct sheep_vm *vm, struct sheep_indirect *indirect)
 {
 	struct sheep_indirect *prev = NULL, *this = vm->pending;
@@ -194,13 +215,16 @@ void sheep_foreign_release(struct sheep_vm *vm, struct sheep_vector *foreign)
 		if (indirect->count > 0) {
 			if (--indirect->count == 0) {
 				unlink_live(vm, indirect);
-				sheep_free(indirect);
+				sheep_cache_free(&vm->cache, indirect,
+						sizeof(struct sheep_indirect));
 			}
 		} else {
 			if (++indirect->count == 0)
-				sheep_free(indirect);
+				sheep_cache_free(&vm->cache, indirect,
+						sizeof(struct sheep_indirect));
 		}
 	}
-	sheep_free(foreign->items);
-	sheep_free(foreign);
+	sheep_cache_free(&vm->cache, foreign->items,
+			foreign->nr_alloc * sizeof(void *));
+	sheep_cache_free(&vm->cache, foreign, sizeof(struct sheep_vector));
 }
@@ -11,6 +11,7 @@
 #include <sheep/util.h>
 #include <sheep/gc.h>
 #include <sheep/vm.h>
+#include <string.h>
 #include <stdio.h>
 
 #include <sheep/function.h>
@@ -25,16 +26,14 @@ static void free_freevar(struct sheep_vector *foreign)
 	sheep_free(foreign);
 }
 
-static void function_free(struct sheep_vm *vm, sheep_t sheep)
+static void function_release(void *payload)
 {
-	struct sheep_function *function;
+	struct sheep_function *function = payload;
 
-	function = sheep_data(sheep);
 	if (function->foreign)
 		free_freevar(function->foreign);
 	sheep_code_exit(&function->code);
 	sheep_free(function->name);
-	sheep_free(function);
 }
 
 static enum sheep_call function_call(struct sheep_vm *vm,
@@ -73,7 +72,7 @@ static void function_format(sheep_t sheep, struct sheep_strbuf *sb, int repr)
 
 const struct sheep_type sheep_function_type = {
 	.name = "function",
-	.free = function_free,
+	.release = function_release,
 	.call = function_call,
 	.format = function_format,
 };
@@ -86,19 +85,29 @@ static void closure_mark(sheep_t sheep)
 	sheep_foreign_mark(closure->foreign);
 }
 
+static void closure_forward(sheep_t sheep)
+{
+	struct sheep_function *closure;
+
+	closure = sheep_data(sheep);
+	sheep_foreign_forward(closure->foreign);
+}
+
 static void closure_free(struct sheep_vm *vm, sheep_t sheep)
 {
 	struct sheep_function *closure;
 
 	closure = sheep_data(sheep);
 	sheep_foreign_release(vm, closure->foreign);
-	sheep_free(closure->name);
-	sheep_free(closure);
+	if (closure->name)
+		sheep_cache_free(&vm->cache, closure->name,
+				strlen(closure->name) + 1);
 }
 
 const struct sheep_type sheep_closure_type = {
 	.name = "function",
 	.mark = closure_mark,
+	.forward = closure_forward,
 	.free = closure_free,
 	.call = function_call,
 	.format = function_format,
@@ -107,23 +116,34 @@ const struct sheep_type sheep_closure_type = {
 sheep_t sheep_make_function(struct sheep_vm *vm, const char *name)
 {
 	struct sheep_function *function;
+	sheep_t sheep;
 
-	function = sheep_zalloc(sizeof(struct sheep_function));
+	sheep = sheep_make_object(vm, &sheep_function_type,
+				sizeof(struct sheep_function));
+	function = sheep_function(sheep);
+	memset(function, 0, sizeof(struct sheep_function));
 	if (name)
 		function->name = sheep_strdup(name);
-	return sheep_make_object(vm, &sheep_function_type, function);
+	return sheep;
 }
 
 sheep_t sheep_closure_function(struct sheep_vm *vm,
 			       struct sheep_function *function)
 {
 	struct sheep_function *closure;
+	sheep_t sheep;
 
-	closure = sheep_malloc(sizeof(struct sheep_function));
+	sheep = sheep_make_object(vm, &sheep_closure_type,
+				sizeof(struct sheep_function));
+	closure = sheep_function(sheep);
 	*closure = *function;
-	if (function->name)
-		closure->name = sheep_strdup(function->name);
-	return sheep_make_object(vm, &sheep_closure_type, closure);
+	if (function->name) {
+		size_t size = strlen(function->name) + 1;
+
+		closure->name = memcpy(sheep_cache_alloc(&vm->cache, size),
+				       function->name, size);
+	}
+	return sheep;
 }
 
 /* (disassemble function) */
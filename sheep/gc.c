@@ -2,222 +2,2648 @@
  * sheep/gc.c
  *
  * Copyright (c) 2009 Johannes Weiner <hannes@cmpxchg.org>
+ *
+ * Generational mark and sweep collector.
+ *
+ * Objects live in naturally aligned slabs, each of which is carved
+ * into cells of one power-of-two size class.  An object's payload is
+ * allocated inline, right behind its header, in the smallest cell
+ * that fits both.  Each slab carries an allocation bitmap and a mark
+ * bitmap in its header, so neither the allocator nor the collector
+ * has to touch live objects to find free cells or to reset the marks.
+ * Objects too big for the largest size class are allocated one by
+ * one and linked on lists of large objects.
+ *
+ * New objects are allocated from the nursery, the slabs that were
+ * allocated into since the last collection.  Allocation scans the
+ * allocation bitmap of the current slab word by word, which
+ * degenerates to bumping a pointer on a fresh slab.  Marks are
+ * sticky: everything that survived a collection keeps its mark bit
+ * and is considered old.
+ *
+ * When the nursery budget is used up, a minor collection marks from the
+ * stack and the remembered set only, stopping at old objects.  The
+ * survivors are promoted in place by leaving their mark bits set.
+ *
+ * Collections sweep nothing but large objects.  Marked slabs are
+ * queued per size class and swept lazily when the allocator runs out
+ * of cells, one slab at a time, running the finalizers of the dead
+ * objects of a slab in one batch.  The heap growth is thus accounted
+ * by the bytes found live rather than by the slabs in use.
+ *
+ * The remembered set holds young objects that were stored into old
+ * objects or roots that are not scanned on minor collections (see
+ * sheep_gc_write()).
+ *
+ * Once the heap has grown beyond the target size derived from the
+ * growth policy (see struct sheep_gc_policy), a major collection
+ * clears all mark bitmaps and traces the whole heap from all roots.
+ *
+ * Tracing is tri-color: an object found reachable whose children
+ * have not been scanned yet sits on the gray stack.  Major collections scan
+ * gray objects in slices of bounded time, one slice every so many
+ * allocated bytes.  In the meantime, new objects are shaded as they
+ * are allocated and the write barrier shades every object stored
+ * into the heap or into a root other than the stack.  The marking
+ * completes by rescanning the roots, and the outstanding sweeping
+ * has to be done before the next major collection clears the marks.
+ *
+ * Types whose finalizer does not need the vm provide a release
+ * function instead.  The sweep only copies the payloads of such dead
+ * objects into a batch, which a finalizer thread then releases while
+ * the mutator goes on using the reclaimed cells.
+ *
+ * Full drains of the gray stack can be spread over a pool of marker
+ * threads, see struct sheep_gc_policy.  The gray objects, initially
+ * the roots, are dealt out to the markers, which mark with atomic
+ * bitmap operations.  Every marker works off a private gray stack and
+ * moves half of it to its shared deque whenever other markers are
+ * idle, which those then steal from.
+ *
+ * Besides the exact roots, the native stack and the registers are
+ * scanned conservatively: any word that points into an allocated
+ * cell or large object keeps that object alive, so C code needs no
+ * explicit protection for the objects in its local variables.  The
+ * slab of such an object is pinned, as the reference might be
+ * anything but a real one, and must not be updated.
+ *
+ * Major collections evacuate sparse slabs: the live objects are
+ * copied into fresh slabs and leave forwarding addresses behind,
+ * then all roots and live objects update their references and the
+ * sparse slabs are released.  Slabs referenced from the native stack
+ * or from protected objects are pinned and stay where they are.
+ * Cached empty slabs and the free pages of sparse slabs are handed
+ * back to the system with madvise().
+ *
+ * Objects holding weak references register with the collector,
+ * which settles them after marking, before anything is swept: their
+ * references to objects left unmarked are cleared, and ephemeron
+ * tables keep values alive only through live keys.
+ *
+ * Allocation regions collect nothing, they are discarded wholesale
+ * when left: objects are bump-allocated into slabs of the region,
+ * and the write barrier records region objects stored into objects
+ * outside of it.  On exit, whatever those, the result, the globals
+ * and the stack reach within the region escapes and is moved out to
+ * the nursery, just like evacuated objects.  The region slabs are
+ * then recycled for the next region.
+ *
+ * Statistics on collections, pauses and allocations are kept in the
+ * vm at all times, see (gc-stats).  Setting SHEEP_GC_TRACE in the
+ * environment logs every collection to stderr.
  */
+#define _GNU_SOURCE
+#include <sheep/foreign.h>
 #include <sheep/vector.h>
+#include <sheep/string.h>
+#include <sheep/number.h>
+#include <sheep/unpack.h>
 #include <sheep/types.h>
+#include <sheep/list.h>
 #include <sheep/util.h>
 #include <sheep/vm.h>
 #include <sys/mman.h>
-#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sched.h>
+#include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <sheep/gc.h>
 
-#define PAGE_SIZE	sysconf(_SC_PAGE_SIZE)
-#define POOL_SIZE	(PAGE_SIZE / sizeof(struct sheep_object))
+/* Default growth policy */
+#define DEFAULT_GROWTH		200
+#define DEFAULT_MIN_HEAP	(8 * SHEEP_SLAB_SIZE)
+#define DEFAULT_PAUSE		1000
+#define DEFAULT_THREADS		1
 
-struct sheep_objects {
-	struct sheep_object *mem;
-	struct sheep_object *free;
-	unsigned int nr_used;
-	struct sheep_objects *next;
-};
+/* Upper bound for the number of marker threads */
+#define MAX_THREADS		64
+
+/*
+ * Incremental marking: allocation between two marking slices, and
+ * objects scanned between checks of the slice's time budget
+ */
+#define SLICE_STEP	(SHEEP_SLAB_SIZE / 16)
+#define SLICE_CHECK	64
+
+/* Objects in flight between the gray stack and the marker */
+#define PREFETCH_DISTANCE	8
+
+/* Nursery size as a fraction of the target heap size */
+#define NURSERY_RATIO	8
+#define NURSERY_MIN	(SHEEP_SLAB_SIZE / 4)
+
+/* Empty slabs cached for reuse by any size class */
+#define EMPTY_SLABS	2
+
+/* Initial size of a batch of payloads queued for release */
+#define RELEASE_BATCH	4096
+
+/*
+ * Parallel marking: gray objects needed to wake up the marker
+ * threads, and gray objects a marker keeps before sharing half of
+ * them with idle markers
+ */
+#define PARALLEL_MIN	64
+#define SHARE_MIN	32
+
+/*
+ * Evacuation: slabs with less than 1/EVACUATE_RATIO of their cells
+ * live are sparse, and evacuated once they make up 1/EVACUATE_RATIO
+ * of the slabs, but at least EVACUATE_MIN of them
+ */
+#define EVACUATE_RATIO	4
+#define EVACUATE_MIN	2
+
+/* Slabs of left regions kept for the next ones */
+#define ARENA_SLABS	4
 
-static struct sheep_objects *alloc_pool(void)
+/* Granularity of returning free memory to the system */
+static unsigned long page_size;
+
+/* Gray stack of the marker thread, for sheep_mark() */
+static __thread struct sheep_vector *gray;
+
+/* Upper end of the native stack of the thread, see stack_end() */
+static __thread void *thread_stack_end;
+
+static struct sheep_slab *alloc_slab(struct sheep_vm *vm)
 {
-	struct sheep_objects *pool;
-	unsigned int i;
+	unsigned long start, aligned;
+	void *mem;
 
-	pool = sheep_malloc(sizeof(struct sheep_objects));
-	pool->mem = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
-			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	/* Overallocate and trim to get natural alignment */
+	mem = mmap(NULL, 2 * SHEEP_SLAB_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		sheep_bug("out of memory for object slabs");
 
-	pool->free = pool->mem;
-	for (i = 0; i < POOL_SIZE - 1; i++)
-		pool->mem[i].data = (unsigned long)&pool->mem[i + 1];
-	pool->nr_used = 0;
-	pool->next = NULL;
-	return pool;
+	start = (unsigned long)mem;
+	aligned = (start + SHEEP_SLAB_SIZE - 1) & ~(SHEEP_SLAB_SIZE - 1);
+	if (aligned > start)
+		munmap(mem, aligned - start);
+	munmap((void *)(aligned + SHEEP_SLAB_SIZE),
+		start + SHEEP_SLAB_SIZE - aligned);
+
+	vm->nr_slabs++;
+	vm->gc_stats.nr_slabs_allocated++;
+	return (struct sheep_slab *)aligned;
 }
 
-static void free_pool(struct sheep_objects *pool)
+static void free_slab(struct sheep_vm *vm, struct sheep_slab *slab)
 {
-	munmap(pool->mem, PAGE_SIZE);
-	sheep_free(pool);
+	munmap(slab, SHEEP_SLAB_SIZE);
+	vm->nr_slabs--;
+	vm->gc_stats.nr_slabs_released++;
+}
+
+static void reset_slab(struct sheep_slab *slab, unsigned int shift)
+{
+	unsigned long word_size = SHEEP_BITS_PER_LONG << shift;
+
+	slab->nr_used = 0;
+	slab->flags = 0;
+	slab->shift = shift;
+	slab->first = (sizeof(struct sheep_slab) + word_size - 1) / word_size;
+	slab->nr_words = SHEEP_SLAB_SIZE / word_size;
+	slab->cursor = slab->first;
+}
+
+static void init_slab(struct sheep_slab *slab, unsigned int shift)
+{
+	reset_slab(slab, shift);
+	memset(slab->alloc, 0, sizeof(slab->alloc));
+	memset(slab->marks, 0, sizeof(slab->marks));
+	memset(slab->final, 0, sizeof(slab->final));
+}
+
+static inline unsigned long slab_capacity(struct sheep_slab *slab)
+{
+	return (slab->nr_words - slab->first) * SHEEP_BITS_PER_LONG;
+}
+
+static inline sheep_t slab_object(struct sheep_slab *slab,
+				  unsigned long word,
+				  unsigned long bit)
+{
+	unsigned long index = word * SHEEP_BITS_PER_LONG + bit;
+
+	return (sheep_t)((unsigned long)slab + (index << slab->shift));
+}
+
+static sheep_t alloc(struct sheep_slab *slab, int final)
+{
+	while (slab->cursor < slab->nr_words) {
+		unsigned long word = slab->cursor;
+		unsigned long free;
+
+		free = ~slab->alloc[word];
+		if (free) {
+			unsigned long bit = __builtin_ctzl(free);
+
+			slab->alloc[word] |= 1UL << bit;
+			if (final)
+				slab->final[word] |= 1UL << bit;
+			slab->nr_used++;
+			return slab_object(slab, word, bit);
+		}
+		slab->cursor++;
+	}
+	return NULL;
+}
+
+/* A fresh slab of a size class, reusing cached empty ones first */
+static struct sheep_slab *new_slab(struct sheep_vm *vm, unsigned int shift)
+{
+	struct sheep_slab *slab;
+
+	if (vm->empty) {
+		slab = vm->empty;
+		vm->empty = slab->next;
+		vm->nr_empty--;
+	} else
+		slab = alloc_slab(vm);
+	init_slab(slab, shift);
+	return slab;
 }
 
-static void unmark_pools(struct sheep_objects *pool)
+/*
+ * Cache an empty slab for reuse or return it to the system.  Cached
+ * slabs keep their address range, but not their memory.
+ */
+static void release_slab(struct sheep_vm *vm, struct sheep_slab *slab)
+{
+	if (vm->nr_empty >= EMPTY_SLABS) {
+		free_slab(vm, slab);
+		return;
+	}
+	madvise(slab, SHEEP_SLAB_SIZE, MADV_DONTNEED);
+	slab->next = vm->empty;
+	vm->empty = slab;
+	vm->nr_empty++;
+}
+
+/* Are @nr cells from @index on, @nr a power of two, all free? */
+static int cells_free(struct sheep_slab *slab, unsigned long index,
+		      unsigned long nr)
 {
-	while (pool) {
-		unsigned int i;
+	unsigned long word = index / SHEEP_BITS_PER_LONG;
+	unsigned long mask;
+
+	if (nr < SHEEP_BITS_PER_LONG) {
+		mask = ((1UL << nr) - 1) << (index % SHEEP_BITS_PER_LONG);
+		return !(slab->alloc[word] & mask);
+	}
+	for (nr /= SHEEP_BITS_PER_LONG; nr; nr--, word++)
+		if (slab->alloc[word])
+			return 0;
+	return 1;
+}
 
-		for (i = 0; i < POOL_SIZE; i++) {
-			struct sheep_object *sheep = &pool->mem[i];
+/* Give the memory of the free pages of a sparse slab back */
+static void release_pages(struct sheep_slab *slab)
+{
+	unsigned long per_page = page_size >> slab->shift;
+	unsigned long index, end, run = 0;
 
-			if (sheep->type)
-				sheep->data &= ~1;
+	index = slab->first * SHEEP_BITS_PER_LONG;
+	index = (index + per_page - 1) & ~(per_page - 1);
+	end = slab->nr_words * SHEEP_BITS_PER_LONG;
+	for (; index <= end; index += per_page) {
+		if (index < end && cells_free(slab, index, per_page)) {
+			run++;
+			continue;
 		}
-		pool = pool->next;
+		if (run)
+			madvise((char *)slab +
+				((index - run * per_page) << slab->shift),
+				run * page_size, MADV_DONTNEED);
+		run = 0;
 	}
 }
 
-static void unmark(struct sheep_vm *vm)
+static void unmark(struct sheep_slab *slab)
+{
+	for (; slab; slab = slab->next)
+		memset(slab->marks, 0, slab->nr_words * sizeof(unsigned long));
+}
+
+static void unmark_large(struct sheep_large *large)
+{
+	for (; large; large = large->next)
+		large->marked = 0;
+}
+
+/* Mark an object and keep its slab from being evacuated */
+static void mark_pinned(sheep_t sheep)
 {
-	unmark_pools(vm->parts);
-	unmark_pools(vm->fulls);
+	if (sheep_gc_object(sheep) && !(sheep->flags & SHEEP_GC_LARGE))
+		sheep_slab(sheep)->flags |= SHEEP_SLAB_PINNED;
+	sheep_mark(sheep);
 }
 
+/*
+ * Protected objects are referenced from places unknown to the
+ * collector, so their slabs are pinned just like the ones referenced
+ * from the native stack.
+ */
 static void mark_protected(struct sheep_vector *protected)
 {
 	unsigned long i;
 
 	for (i = 0; i < protected->nr_items; i++)
-		sheep_mark(protected->items[i]);
+		mark_pinned(protected->items[i]);
+}
+
+/*
+ * The operator instructions compare globals against the builtin
+ * operators by address, see sheep_vm_operator().  They stay in
+ * place, and are forwarded along with the globals all the same.
+ */
+static void mark_operators(struct sheep_vm *vm)
+{
+	unsigned int i;
+
+	for (i = 0; i < SHEEP_NR_OPERATORS; i++)
+		mark_pinned(vm->operators[i]);
 }
 
-static unsigned int collect_pool(struct sheep_vm *vm,
-				 struct sheep_objects *pool)
+void __sheep_gc_remember(struct sheep_vm *vm, sheep_t sheep)
 {
-	unsigned int i, moved;
+	sheep->flags |= SHEEP_GC_REMEMBERED;
+	sheep_vector_push(&vm->remembered, sheep);
+}
 
-	for (i = moved = 0; i < POOL_SIZE; i++) {
-		struct sheep_object *sheep = &pool->mem[i];
+static void mark_remembered(struct sheep_vm *vm)
+{
+	unsigned long i;
 
-		if (sheep->data & 1)
-			continue;
+	for (i = 0; i < vm->remembered.nr_items; i++) {
+		sheep_t sheep = vm->remembered.items[i];
 
-		if (sheep->type->free)
-			sheep->type->free(vm, sheep);
+		sheep->flags &= ~SHEEP_GC_REMEMBERED;
+		sheep_mark(sheep);
+	}
+	vm->remembered.nr_items = 0;
+	vm->arena.remembered = 0;
+}
+
+static void forget_remembered(struct sheep_vm *vm)
+{
+	unsigned long i;
+
+	for (i = 0; i < vm->remembered.nr_items; i++) {
+		sheep_t sheep = vm->remembered.items[i];
 
-		sheep->data = (unsigned long)pool->free;
-		sheep->type = NULL;
-		pool->free = &pool->mem[i];
-		pool->nr_used--;
-		moved++;
+		sheep->flags &= ~SHEEP_GC_REMEMBERED;
 	}
-	return moved;
+	vm->remembered.nr_items = 0;
+	vm->arena.remembered = 0;
 }
 
-static void collect(struct sheep_vm *vm)
+/*
+ * A payload copy queued for release, padded to keep the next entry
+ * aligned
+ */
+struct release_entry {
+	void (*release)(void *);
+	size_t size;
+	unsigned long payload[];
+};
+
+struct release_batch {
+	struct release_batch *next;
+	size_t nr_bytes;
+	size_t nr_alloc;
+	char *entries;
+};
+
+struct sheep_finalizer {
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	pthread_t thread;
+	struct release_batch *queue;
+	int stop;
+};
+
+static void queue_release(struct release_batch **batchp,
+			  sheep_t sheep, size_t size)
 {
-	struct sheep_objects *pool, *next,
-		*cache_part = NULL, *last_full = NULL;
+	struct release_batch *batch = *batchp;
+	struct release_entry *entry;
+	size_t len;
 
-	if (vm->gc_disabled)
-		goto alloc;
+	size -= sizeof(struct sheep_object);
+	len = sizeof(struct release_entry) +
+		((size + sizeof(long) - 1) & ~(sizeof(long) - 1));
 
-	unmark(vm);
-	sheep_vm_mark(vm);
-	mark_protected(&vm->protected);
+	if (!batch)
+		batch = *batchp = sheep_zalloc(sizeof(struct release_batch));
+	if (batch->nr_bytes + len > batch->nr_alloc) {
+		if (!batch->nr_alloc)
+			batch->nr_alloc = RELEASE_BATCH;
+		while (batch->nr_bytes + len > batch->nr_alloc)
+			batch->nr_alloc *= 2;
+		batch->entries = sheep_realloc(batch->entries, batch->nr_alloc);
+	}
+
+	entry = (struct release_entry *)(batch->entries + batch->nr_bytes);
+	entry->release = sheep->type->release;
+	entry->size = len;
+	memcpy(entry->payload, sheep_data(sheep), size);
+	batch->nr_bytes += len;
+}
+
+static void run_batch(struct release_batch *batch)
+{
+	size_t pos = 0;
+
+	while (pos < batch->nr_bytes) {
+		struct release_entry *entry;
+
+		entry = (struct release_entry *)(batch->entries + pos);
+		entry->release(entry->payload);
+		pos += entry->size;
+	}
+	sheep_free(batch->entries);
+	sheep_free(batch);
+}
+
+static void *finalizer_thread(void *arg)
+{
+	struct sheep_finalizer *finalizer = arg;
+	sigset_t all;
 
-	for (pool = vm->fulls; pool; pool = next) {
-		unsigned int moved;
+	/* Leave the signals to the vm thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
 
-		moved = collect_pool(vm, pool);
-		next = pool->next;
+	pthread_mutex_lock(&finalizer->lock);
+	for (;;) {
+		struct release_batch *batch, *next;
 
-		if (!moved) {
-			last_full = pool;
+		batch = finalizer->queue;
+		if (!batch) {
+			if (finalizer->stop)
+				break;
+			pthread_cond_wait(&finalizer->wakeup, &finalizer->lock);
 			continue;
 		}
+		finalizer->queue = NULL;
+		pthread_mutex_unlock(&finalizer->lock);
+
+		for (; batch; batch = next) {
+			next = batch->next;
+			run_batch(batch);
+		}
+
+		pthread_mutex_lock(&finalizer->lock);
+	}
+	pthread_mutex_unlock(&finalizer->lock);
+	return NULL;
+}
+
+/* Hand a batch to the finalizer thread, starting it on first use */
+static void submit_release(struct sheep_vm *vm, struct release_batch *batch)
+{
+	struct sheep_finalizer *finalizer = vm->finalizer;
+
+	if (!finalizer) {
+		finalizer = sheep_zalloc(sizeof(struct sheep_finalizer));
+		pthread_mutex_init(&finalizer->lock, NULL);
+		pthread_cond_init(&finalizer->wakeup, NULL);
+		if (pthread_create(&finalizer->thread, NULL,
+				   finalizer_thread, finalizer)) {
+			pthread_cond_destroy(&finalizer->wakeup);
+			pthread_mutex_destroy(&finalizer->lock);
+			sheep_free(finalizer);
+			run_batch(batch);
+			return;
+		}
+		vm->finalizer = finalizer;
+	}
+
+	pthread_mutex_lock(&finalizer->lock);
+	batch->next = finalizer->queue;
+	finalizer->queue = batch;
+	pthread_cond_signal(&finalizer->wakeup);
+	pthread_mutex_unlock(&finalizer->lock);
+}
+
+/* Wait for the queued releases to finish and stop the thread */
+static void stop_finalizer(struct sheep_vm *vm)
+{
+	struct sheep_finalizer *finalizer = vm->finalizer;
+
+	if (!finalizer)
+		return;
+
+	pthread_mutex_lock(&finalizer->lock);
+	finalizer->stop = 1;
+	pthread_cond_signal(&finalizer->wakeup);
+	pthread_mutex_unlock(&finalizer->lock);
+
+	pthread_join(finalizer->thread, NULL);
+	pthread_cond_destroy(&finalizer->wakeup);
+	pthread_mutex_destroy(&finalizer->lock);
+	sheep_free(finalizer);
+	vm->finalizer = NULL;
+}
+
+/*
+ * Free everything allocated but unmarked, a word at a time.  Only
+ * dead objects that need finalization are touched, their finalizers
+ * run in one batch per slab.
+ */
+static void free_cells(struct sheep_vm *vm, struct sheep_slab *slab,
+		       unsigned long word, unsigned long dead,
+		       struct release_batch **batchp)
+{
+	unsigned long final;
+
+	slab->alloc[word] &= ~dead;
+	slab->nr_used -= __builtin_popcountl(dead);
+
+	final = dead & slab->final[word];
+	slab->final[word] &= ~final;
+	while (final) {
+		sheep_t sheep;
 
-		if (last_full)
-			last_full->next = pool->next;
+		sheep = slab_object(slab, word, __builtin_ctzl(final));
+		if (sheep->type->release)
+			queue_release(batchp, sheep, 1UL << slab->shift);
 		else
-			vm->fulls = pool->next;
+			sheep->type->free(vm, sheep);
+
+		final &= final - 1;
+	}
+}
 
-		if (moved < POOL_SIZE || !cache_part) {
-			pool->next = vm->parts;
-			vm->parts = cache_part = pool;
-		} else
-			free_pool(pool);
+static void sweep_slab(struct sheep_vm *vm, struct sheep_slab *slab)
+{
+	struct release_batch *batch = NULL;
+	unsigned long word;
+
+	for (word = slab->first; word < slab->nr_words; word++) {
+		unsigned long dead;
+
+		dead = slab->alloc[word] & ~slab->marks[word];
+		if (dead)
+			free_cells(vm, slab, word, dead, &batch);
 	}
+	if (batch)
+		submit_release(vm, batch);
+	slab->flags &= ~SHEEP_SLAB_UNSWEPT;
+	slab->cursor = slab->first;
+}
 
-alloc:
-	if (!vm->parts)
-		vm->parts = alloc_pool();
+/* Queue a list of marked slabs for sweeping at allocation time */
+static void defer_sweep(struct sheep_cells *cells, struct sheep_slab *slab)
+{
+	struct sheep_slab *next;
+
+	for (; slab; slab = next) {
+		next = slab->next;
+		slab->flags |= SHEEP_SLAB_UNSWEPT;
+		slab->next = cells->unswept;
+		cells->unswept = slab;
+	}
 }
 
-static sheep_t alloc(struct sheep_vm *vm)
+/*
+ * Sweep a list of slabs and sort them into the slab heap of their
+ * size class.  A few empty slabs are cached to serve the next
+ * nursery refills, the rest is returned to the system, as are the
+ * free pages of sparse slabs.
+ */
+static void sweep_slabs(struct sheep_vm *vm,
+			struct sheep_cells *cells,
+			struct sheep_slab *slab)
 {
-	struct sheep_object *sheep;
+	struct sheep_slab *next;
+
+	for (; slab; slab = next) {
+		next = slab->next;
 
-	sheep = vm->parts->free;
-	vm->parts->nr_used++;
+		sweep_slab(vm, slab);
 
-	if (vm->parts->nr_used < POOL_SIZE)
-		vm->parts->free = (struct sheep_object *)sheep->data;
-	else {
-		struct sheep_objects *pool;
+		if (!slab->nr_used) {
+			release_slab(vm, slab);
+			continue;
+		}
 
-		pool = vm->parts;
-		vm->parts = vm->parts->next;
+		if (slab->nr_used * EVACUATE_RATIO < slab_capacity(slab))
+			release_pages(slab);
 
-		pool->next = vm->fulls;
-		vm->fulls = pool;
+		if (slab->nr_used < slab_capacity(slab)) {
+			slab->next = cells->parts;
+			cells->parts = slab;
+		} else {
+			slab->next = cells->fulls;
+			cells->fulls = slab;
+		}
 	}
-	return sheep;
 }
 
-struct sheep_object *sheep_gc_alloc(struct sheep_vm *vm)
+/* Free unmarked large objects, promote the survivors */
+static void sweep_large(struct sheep_vm *vm, struct sheep_large *large)
 {
-	if (!vm->parts)
-		collect(vm);
+	struct release_batch *batch = NULL;
+	struct sheep_large *next;
+
+	for (; large; large = next) {
+		sheep_t sheep = (sheep_t)(large + 1);
+
+		next = large->next;
+		if (large->marked) {
+			large->next = vm->old_large;
+			vm->old_large = large;
+			continue;
+		}
+		if (sheep->type->release)
+			queue_release(&batch, sheep, large->size);
+		else if (sheep->type->free)
+			sheep->type->free(vm, sheep);
+		vm->large_size -= large->size;
+		sheep_free(large);
+	}
+	if (batch)
+		submit_release(vm, batch);
+}
 
-	return alloc(vm);
+static size_t heap_size(struct sheep_vm *vm)
+{
+	return vm->nr_slabs * SHEEP_SLAB_SIZE + vm->large_size;
 }
 
-void sheep_mark(sheep_t sheep)
+/* Derive the next full collection and the nursery from the policy */
+static void set_target(struct sheep_vm *vm)
+{
+	struct sheep_gc_policy *policy = &vm->gc_policy;
+
+	vm->gc_target = vm->gc_live / 100 * policy->growth;
+	if (vm->gc_target < policy->min_heap)
+		vm->gc_target = policy->min_heap;
+
+	if (vm->gc_marking)
+		return;
+
+	vm->gc_budget = vm->gc_target / NURSERY_RATIO;
+	if (vm->gc_budget < NURSERY_MIN)
+		vm->gc_budget = NURSERY_MIN;
+}
+
+static unsigned long now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Set the mark bit of a heap object, return whether it was set.
+ * Newly marked bytes are accounted to the collection.
+ */
+static int test_and_mark(struct sheep_vm *vm, sheep_t sheep)
+{
+	struct sheep_slab *slab;
+	unsigned long index, bit, *word;
+
+	if (sheep->flags & SHEEP_GC_LARGE) {
+		struct sheep_large *large = sheep_large(sheep);
+
+		if (large->marked)
+			return 1;
+		large->marked = 1;
+		vm->gc_marked += large->size;
+		return 0;
+	}
+
+	slab = sheep_slab(sheep);
+	index = sheep_slab_index(sheep);
+	word = &slab->marks[index / SHEEP_BITS_PER_LONG];
+	bit = 1UL << (index % SHEEP_BITS_PER_LONG);
+	if (*word & bit)
+		return 1;
+	*word |= bit;
+	vm->gc_marked += 1UL << slab->shift;
+	return 0;
+}
+
+static inline void push_gray(struct sheep_vector *stack, sheep_t sheep)
+{
+	if (stack->nr_items < stack->nr_alloc)
+		stack->items[stack->nr_items++] = sheep;
+	else
+		sheep_vector_push(stack, sheep);
+}
+
+static void scan(struct sheep_vm *vm, sheep_t sheep)
 {
-	if (sheep_is_fixnum(sheep))
+	if (!(sheep->flags & SHEEP_GC_HEAP))
 		return;
-	if (sheep->data & 1)
+	if (test_and_mark(vm, sheep))
 		return;
-	sheep->data |= 1;
-	if (sheep_type(sheep)->mark)
-		sheep_type(sheep)->mark(sheep);
+	if (sheep->type->mark)
+		sheep->type->mark(sheep);
 }
 
-void sheep_protect(struct sheep_vm *vm, sheep_t sheep)
+struct marker {
+	struct sheep_markers *pool;
+	struct sheep_vector gray;
+	pthread_mutex_t lock;
+	struct sheep_vector shared;
+	size_t marked;
+};
+
+struct sheep_markers {
+	struct marker *markers;
+	pthread_t *threads;
+	unsigned int nr_markers;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned long round;
+	unsigned int nr_busy;
+	unsigned int nr_idle;
+	int stop;
+};
+
+static int test_and_mark_atomic(struct marker *marker, sheep_t sheep)
 {
-	sheep_vector_push(&vm->protected, sheep);
+	struct sheep_slab *slab;
+	unsigned long index, bit, *word;
+
+	if (sheep->flags & SHEEP_GC_LARGE) {
+		struct sheep_large *large = sheep_large(sheep);
+
+		if (__atomic_exchange_n(&large->marked, 1, __ATOMIC_RELAXED))
+			return 1;
+		marker->marked += large->size;
+		return 0;
+	}
+
+	slab = sheep_slab(sheep);
+	index = sheep_slab_index(sheep);
+	word = &slab->marks[index / SHEEP_BITS_PER_LONG];
+	bit = 1UL << (index % SHEEP_BITS_PER_LONG);
+	if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+		return 1;
+	if (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit)
+		return 1;
+	marker->marked += 1UL << slab->shift;
+	return 0;
 }
 
-void sheep_unprotect(struct sheep_vm *vm, sheep_t sheep)
+/*
+ * Move the older half of the private gray stack to the shared deque.
+ * The size of the deque is peeked at without the lock, it is only
+ * ever updated atomically.
+ */
+static void share(struct marker *marker)
 {
-	sheep_t prot;
+	struct sheep_vector *shared = &marker->shared;
+	unsigned long nr = marker->gray.nr_items / 2;
 
-	prot = sheep_vector_pop(&vm->protected);
-	sheep_bug_on(prot != sheep);
+	pthread_mutex_lock(&marker->lock);
+	if (shared->nr_items + nr > shared->nr_alloc) {
+		shared->nr_alloc = 2 * (shared->nr_items + nr);
+		shared->items = sheep_realloc(shared->items,
+					shared->nr_alloc * sizeof(void *));
+	}
+	memcpy(shared->items + shared->nr_items, marker->gray.items,
+	       nr * sizeof(void *));
+	__atomic_store_n(&shared->nr_items, shared->nr_items + nr,
+			 __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&marker->lock);
+
+	memmove(marker->gray.items, marker->gray.items + nr,
+		(marker->gray.nr_items - nr) * sizeof(void *));
+	marker->gray.nr_items -= nr;
+}
+
+/* Take half the shared work of some marker, own deque first */
+static int steal(struct sheep_markers *pool, struct marker *marker)
+{
+	unsigned int i, first = marker - pool->markers;
+
+	for (i = 0; i < pool->nr_markers; i++) {
+		struct marker *victim;
+		unsigned long nr;
+
+		victim = &pool->markers[(first + i) % pool->nr_markers];
+		if (!__atomic_load_n(&victim->shared.nr_items, __ATOMIC_RELAXED))
+			continue;
+
+		pthread_mutex_lock(&victim->lock);
+		nr = (victim->shared.nr_items + 1) / 2;
+		__atomic_store_n(&victim->shared.nr_items,
+				 victim->shared.nr_items - nr, __ATOMIC_RELAXED);
+		while (nr--)
+			push_gray(&marker->gray,
+				  victim->shared.items[victim->shared.nr_items + nr]);
+		pthread_mutex_unlock(&victim->lock);
+
+		if (marker->gray.nr_items)
+			return 1;
+	}
+	return 0;
 }
 
-static void drain_pool(struct sheep_vm *vm, struct sheep_objects *pool)
+static int shared_work(struct sheep_markers *pool)
 {
 	unsigned int i;
 
-	for (i = 0; i < POOL_SIZE; i++) {
-		struct sheep_object *sheep = &pool->mem[i];
+	for (i = 0; i < pool->nr_markers; i++)
+		if (__atomic_load_n(&pool->markers[i].shared.nr_items,
+				    __ATOMIC_RELAXED))
+			return 1;
+	return 0;
+}
 
-		if (sheep->type && sheep->type->free)
-			sheep->type->free(vm, sheep);
+/*
+ * Mark until all markers run dry.  A marker goes idle only after
+ * failing to steal, and the shared deques only fill up while some
+ * marker is still busy, so once every marker is idle, there is no
+ * work left anywhere.
+ */
+static void mark_parallel(struct sheep_markers *pool, struct marker *marker)
+{
+	gray = &marker->gray;
+	for (;;) {
+		while (marker->gray.nr_items) {
+			sheep_t sheep;
+
+			sheep = marker->gray.items[--marker->gray.nr_items];
+			if (!(sheep->flags & SHEEP_GC_HEAP))
+				continue;
+			if (test_and_mark_atomic(marker, sheep))
+				continue;
+			if (sheep->type->mark)
+				sheep->type->mark(sheep);
+
+			if (marker->gray.nr_items >= SHARE_MIN &&
+			    __atomic_load_n(&pool->nr_idle, __ATOMIC_RELAXED))
+				share(marker);
+		}
+
+		if (steal(pool, marker))
+			continue;
+
+		__atomic_add_fetch(&pool->nr_idle, 1, __ATOMIC_SEQ_CST);
+		for (;;) {
+			if (__atomic_load_n(&pool->nr_idle, __ATOMIC_SEQ_CST) ==
+			    pool->nr_markers)
+				return;
+			if (shared_work(pool)) {
+				__atomic_sub_fetch(&pool->nr_idle, 1,
+						   __ATOMIC_SEQ_CST);
+				if (steal(pool, marker))
+					break;
+				__atomic_add_fetch(&pool->nr_idle, 1,
+						   __ATOMIC_SEQ_CST);
+			}
+			sched_yield();
+		}
 	}
 }
 
-void sheep_gc_exit(struct sheep_vm *vm)
+static void *marker_thread(void *arg)
+{
+	struct marker *marker = arg;
+	struct sheep_markers *pool = marker->pool;
+	unsigned long round = 0;
+	sigset_t all;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->round == round && !pool->stop)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->stop)
+			break;
+		round = pool->round;
+		pthread_mutex_unlock(&pool->lock);
+
+		mark_parallel(pool, marker);
+
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->nr_busy)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void stop_markers(struct sheep_vm *vm)
 {
-	struct sheep_objects *next;
+	struct sheep_markers *pool = vm->markers;
+	unsigned int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 1; i < pool->nr_markers; i++) {
+		pthread_join(pool->threads[i], NULL);
+		sheep_free(pool->markers[i].gray.items);
+	}
+	for (i = 0; i < pool->nr_markers; i++) {
+		pthread_mutex_destroy(&pool->markers[i].lock);
+		sheep_free(pool->markers[i].shared.items);
+	}
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	sheep_free(pool->threads);
+	sheep_free(pool->markers);
+	sheep_free(pool);
+	vm->markers = NULL;
+}
+
+/*
+ * The vm thread is marker 0 and uses the vm's gray stack, the other
+ * markers run on threads of their own.  Markers whose thread can not
+ * be started are left out.
+ */
+static struct sheep_markers *start_markers(struct sheep_vm *vm)
+{
+	unsigned int i, nr = vm->gc_policy.threads;
+	struct sheep_markers *pool;
+
+	pool = sheep_zalloc(sizeof(struct sheep_markers));
+	pool->markers = sheep_zalloc(nr * sizeof(struct marker));
+	pool->threads = sheep_zalloc(nr * sizeof(pthread_t));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (i = 0; i < nr; i++) {
+		pool->markers[i].pool = pool;
+		pthread_mutex_init(&pool->markers[i].lock, NULL);
+	}
+
+	pool->nr_markers = 1;
+	for (i = 1; i < nr; i++) {
+		if (pthread_create(&pool->threads[i], NULL,
+				   marker_thread, &pool->markers[i]))
+			break;
+		pool->nr_markers++;
+	}
+	vm->markers = pool;
+	return pool;
+}
+
+/* Drain the gray stack completely, with all markers */
+static void drain_parallel(struct sheep_vm *vm)
+{
+	struct sheep_markers *pool = vm->markers;
+	struct marker *main;
+	unsigned long i;
+
+	if (!pool)
+		pool = start_markers(vm);
+
+	/* Deal out the gray objects */
+	main = &pool->markers[0];
+	main->gray = vm->gray;
+	for (i = 1; i < pool->nr_markers; i++) {
+		struct marker *marker = &pool->markers[i];
+		unsigned long nr;
+
+		nr = main->gray.nr_items / (pool->nr_markers - i + 1);
+		main->gray.nr_items -= nr;
+		while (nr--)
+			push_gray(&marker->gray,
+				  main->gray.items[main->gray.nr_items + nr]);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->nr_idle = 0;
+	pool->nr_busy = pool->nr_markers - 1;
+	pool->round++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	mark_parallel(pool, main);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->nr_busy)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	vm->gray = main->gray;
+	memset(&main->gray, 0, sizeof(main->gray));
+	for (i = 0; i < pool->nr_markers; i++) {
+		vm->gc_marked += pool->markers[i].marked;
+		pool->markers[i].marked = 0;
+	}
+	gray = &vm->gray;
+}
+
+/*
+ * Scan gray objects until there are none left or the time budget
+ * of @pause microseconds, if any, runs out.  Returns whether the
+ * gray stack was emptied.
+ *
+ * Objects are not scanned straight off the gray stack but pass
+ * through a small FIFO first.  They are prefetched on the way in,
+ * so the memory access overlaps with scanning the objects ahead of
+ * them instead of stalling the marker on every pointer.
+ */
+static int drain(struct sheep_vm *vm, unsigned long pause)
+{
+	unsigned long deadline = 0, nr = 0;
+	sheep_t fifo[PREFETCH_DISTANCE];
+	unsigned int head = 0, nr_fifo = 0;
+
+	if (pause)
+		deadline = now() + pause;
+	else if (vm->gc_policy.threads > 1 &&
+		 vm->gray.nr_items >= PARALLEL_MIN) {
+		drain_parallel(vm);
+		return 1;
+	}
+
+	gray = &vm->gray;
+	while (vm->gray.nr_items || nr_fifo) {
+		sheep_t sheep;
+
+		while (nr_fifo < PREFETCH_DISTANCE && vm->gray.nr_items) {
+			sheep = vm->gray.items[--vm->gray.nr_items];
+			__builtin_prefetch(sheep);
+			fifo[(head + nr_fifo++) % PREFETCH_DISTANCE] = sheep;
+		}
+
+		sheep = fifo[head];
+		head = (head + 1) % PREFETCH_DISTANCE;
+		nr_fifo--;
+		scan(vm, sheep);
+
+		if (pause && !(++nr % SLICE_CHECK) && now() >= deadline) {
+			while (nr_fifo--) {
+				push_gray(&vm->gray, fifo[head]);
+				head = (head + 1) % PREFETCH_DISTANCE;
+			}
+			return 0;
+		}
+	}
+	return 1;
+}
+
+#ifdef __SANITIZE_ADDRESS__
+#define NO_SANITIZE	__attribute__((no_sanitize_address))
+#else
+#define NO_SANITIZE
+#endif
+
+static int compare_addresses(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void sort_addresses(struct sheep_vector *vector)
+{
+	/* Never allocated when empty */
+	if (!vector->nr_items)
+		return;
+	qsort(vector->items, vector->nr_items, sizeof(void *),
+	      compare_addresses);
+}
+
+/* Last item of a sorted vector at or below @addr */
+static void *lookup_address(struct sheep_vector *sorted, unsigned long addr)
+{
+	unsigned long lo = 0, hi = sorted->nr_items;
+
+	while (lo < hi) {
+		unsigned long mid = (lo + hi) / 2;
+
+		if ((unsigned long)sorted->items[mid] <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? sorted->items[lo - 1] : NULL;
+}
+
+static void add_slabs(struct sheep_vector *slabs, struct sheep_slab *slab)
+{
+	for (; slab; slab = slab->next) {
+		slab->flags &= ~SHEEP_SLAB_PINNED;
+		sheep_vector_push(slabs, slab);
+	}
+}
+
+static void add_large(struct sheep_vector *larges, struct sheep_large *large)
+{
+	for (; large; large = large->next)
+		sheep_vector_push(larges, large);
+}
+
+/* The object in a slab that @addr points into, if any */
+static sheep_t slab_reference(struct sheep_slab *slab, unsigned long addr)
+{
+	unsigned long index, word, bit;
+
+	index = (addr - (unsigned long)slab) >> slab->shift;
+	word = index / SHEEP_BITS_PER_LONG;
+	bit = 1UL << (index % SHEEP_BITS_PER_LONG);
+	if (word < slab->first || word >= slab->nr_words)
+		return NULL;
+	if (!(slab->alloc[word] & bit))
+		return NULL;
+	/* Unmarked cells of an unswept slab are dead already */
+	if ((slab->flags & SHEEP_SLAB_UNSWEPT) && !(slab->marks[word] & bit))
+		return NULL;
+	return slab_object(slab, word, index % SHEEP_BITS_PER_LONG);
+}
+
+/*
+ * Upper end of the native stack of the calling thread.  A vm can
+ * move between threads, so this is looked up by the thread that
+ * collects, not by the one that set up the vm.
+ */
+static void *stack_end(void)
+{
+	pthread_attr_t attr;
+	size_t size;
+	void *addr;
+
+	if (thread_stack_end)
+		return thread_stack_end;
+	if (pthread_getattr_np(pthread_self(), &attr))
+		sheep_bug("can not find the stack of the collecting thread");
+	pthread_attr_getstack(&attr, &addr, &size);
+	pthread_attr_destroy(&attr);
+	thread_stack_end = (char *)addr + size;
+	return thread_stack_end;
+}
+
+/*
+ * Scan the stack from this frame up, the caller has spilled the
+ * registers into its own frame.
+ */
+static NO_SANITIZE __attribute__((noinline))
+void scan_stack(struct sheep_vm *vm, struct sheep_vector *slabs,
+		struct sheep_vector *larges)
+{
+	unsigned long *pos = __builtin_frame_address(0);
+	unsigned long *end = stack_end();
+
+	for (; pos < end; pos++) {
+		unsigned long addr = *pos, base;
+		struct sheep_large *large;
+		struct sheep_slab *slab;
+		sheep_t sheep;
+
+		base = addr & ~(SHEEP_SLAB_SIZE - 1);
+		slab = lookup_address(slabs, base);
+		if (slab && (unsigned long)slab == base) {
+			sheep = slab_reference(slab, addr);
+			if (sheep) {
+				slab->flags |= SHEEP_SLAB_PINNED;
+				sheep_mark(sheep);
+			}
+			continue;
+		}
+
+		large = lookup_address(larges, addr);
+		if (!large)
+			continue;
+		sheep = (sheep_t)(large + 1);
+		if (addr < (unsigned long)sheep + large->size)
+			sheep_mark(sheep);
+	}
+}
+
+static void mark_stack(struct sheep_vm *vm)
+{
+	struct sheep_vector slabs = { 0 }, larges = { 0 };
+	unsigned int i;
+
+	for (i = 0; i < SHEEP_CELL_CLASSES; i++) {
+		add_slabs(&slabs, vm->cells[i].nursery);
+		add_slabs(&slabs, vm->cells[i].parts);
+		add_slabs(&slabs, vm->cells[i].fulls);
+		add_slabs(&slabs, vm->cells[i].unswept);
+		add_slabs(&slabs, vm->arena.slabs[i]);
+	}
+	sort_addresses(&slabs);
+	add_large(&larges, vm->young_large);
+	add_large(&larges, vm->old_large);
+	sort_addresses(&larges);
+
+	__builtin_unwind_init();
+	scan_stack(vm, &slabs, &larges);
+
+	sheep_free(slabs.items);
+	sheep_free(larges.items);
+}
+
+static void mark_vector(struct sheep_vector *vector)
+{
+	unsigned long i;
+
+	for (i = 0; i < vector->nr_items; i++)
+		sheep_mark(vector->items[i]);
+}
+
+/* The stack goes first, it resets the pins */
+static void mark_roots(struct sheep_vm *vm)
+{
+	gray = &vm->gray;
+	mark_stack(vm);
+	sheep_vm_mark(vm);
+	mark_protected(&vm->protected);
+	mark_operators(vm);
+	/* Kept until the region is left, see sheep_gc_arena_exit() */
+	mark_vector(&vm->arena.escapes);
+}
+
+/* Let the ephemeron tables among @holders mark through live keys */
+static int mark_ephemerons(struct sheep_vector *holders)
+{
+	unsigned long i;
+	int marked = 0;
+
+	for (i = 0; i < holders->nr_items; i++) {
+		sheep_t sheep = holders->items[i];
+
+		if (!sheep->type->ephemeron || !sheep_gc_marked(sheep))
+			continue;
+		if (sheep->type->ephemeron(sheep))
+			marked = 1;
+	}
+	return marked;
+}
+
+/* Clear the weak references of the live @holders, keep them on @live */
+static void clear_weak(struct sheep_vector *holders, struct sheep_vector *live)
+{
+	unsigned long i, nr = 0;
+
+	for (i = 0; i < holders->nr_items; i++) {
+		sheep_t sheep = holders->items[i];
+
+		if (!sheep_gc_marked(sheep))
+			continue;
+		sheep->type->weak(sheep);
+		if (holders == live)
+			holders->items[nr++] = sheep;
+		else
+			sheep_vector_push(live, sheep);
+	}
+	holders->nr_items = nr;
+}
+
+/*
+ * Settle the weak references after marking, before anything is
+ * swept.  Ephemeron tables mark the values of live keys until that
+ * reaches no new objects, then all dead objects are dropped.  Minor
+ * collections settle only the holders allocated since the last
+ * collection: everything stored into old tables is remembered and
+ * stays alive until the next full collection.
+ */
+static void settle_weak(struct sheep_vm *vm, int major)
+{
+	int marked;
+
+	do {
+		marked = mark_ephemerons(&vm->young_weak);
+		if (major && mark_ephemerons(&vm->old_weak))
+			marked = 1;
+		if (marked)
+			drain(vm, 0);
+	} while (marked);
+
+	if (major)
+		clear_weak(&vm->old_weak, &vm->old_weak);
+	clear_weak(&vm->young_weak, &vm->old_weak);
+}
+
+static void collect_minor(struct sheep_vm *vm)
+{
+	struct sheep_large *large;
+	unsigned int i;
+
+	gray = &vm->gray;
+	mark_stack(vm);
+	sheep_vm_mark_frames(vm);
+	mark_protected(&vm->protected);
+	mark_operators(vm);
+	mark_vector(&vm->arena.escapes);
+	mark_remembered(vm);
+	drain(vm, 0);
+	settle_weak(vm, 0);
+
+	for (i = 0; i < SHEEP_CELL_CLASSES; i++) {
+		struct sheep_cells *cells = &vm->cells[i];
+
+		defer_sweep(cells, cells->nursery);
+		cells->nursery = NULL;
+	}
+
+	large = vm->young_large;
+	vm->young_large = NULL;
+	sweep_large(vm, large);
+}
+
+/*
+ * Begin a full collection: finish sweeping, since the marks are
+ * about to go, clear all marks and shade the roots.  The marking
+ * then advances in slices, see step_major().  Minor collections are
+ * suspended until the cycle completes.
+ */
+static void start_major(struct sheep_vm *vm)
+{
+	unsigned int i;
+
+	for (i = 0; i < SHEEP_CELL_CLASSES; i++) {
+		struct sheep_cells *cells = &vm->cells[i];
+		struct sheep_slab *unswept = cells->unswept;
+
+		cells->unswept = NULL;
+		sweep_slabs(vm, cells, unswept);
+
+		unmark(vm->cells[i].nursery);
+		unmark(vm->cells[i].parts);
+		unmark(vm->cells[i].fulls);
+		unmark(vm->arena.slabs[i]);
+	}
+	unmark_large(vm->young_large);
+	unmark_large(vm->old_large);
+	forget_remembered(vm);
+
+	vm->gc_marking = 1;
+	vm->gc_marked = 0;
+	vm->gc_budget = SLICE_STEP;
+	mark_roots(vm);
+}
+
+/*
+ * Objects can be moved once every type that holds references knows
+ * how to update them.  Types that did not fit into the statistics
+ * are unknown.
+ */
+static int can_evacuate(struct sheep_vm *vm)
+{
+	struct sheep_gc_stats *stats = &vm->gc_stats;
+	unsigned int i, nr = 0;
+
+	for (i = 0; i < SHEEP_GC_TYPES; i++) {
+		const struct sheep_type *type = stats->types[i];
+
+		if (!type)
+			continue;
+		if ((type->mark || type->weak) && !type->forward)
+			return 0;
+		nr++;
+	}
+	return nr < SHEEP_GC_TYPES;
+}
+
+static int sparse(struct sheep_slab *slab)
+{
+	unsigned long word, live = 0;
+
+	if (slab->flags & SHEEP_SLAB_PINNED)
+		return 0;
+	for (word = slab->first; word < slab->nr_words; word++)
+		live += __builtin_popcountl(slab->alloc[word] &
+					    slab->marks[word]);
+	return live * EVACUATE_RATIO < slab_capacity(slab);
+}
+
+/* Allocate a marked cell to evacuate an object to */
+static sheep_t evacuation_cell(struct sheep_vm *vm,
+			       struct sheep_cells *cells,
+			       struct sheep_slab **destp,
+			       unsigned int shift,
+			       int final)
+{
+	struct sheep_slab *dest = *destp;
+	unsigned long index;
+	sheep_t sheep;
+
+	if (!dest || !(sheep = alloc(dest, final))) {
+		if (dest) {
+			dest->next = cells->fulls;
+			cells->fulls = dest;
+		}
+		*destp = dest = new_slab(vm, shift);
+		sheep = alloc(dest, final);
+	}
+	index = sheep_slab_index(sheep);
+	dest->marks[index / SHEEP_BITS_PER_LONG] |=
+		1UL << (index % SHEEP_BITS_PER_LONG);
+	return sheep;
+}
+
+/*
+ * Move the live objects out of a slab, leaving forwarding addresses
+ * behind, and sweep the dead ones.  The finalization duty moves
+ * along with the objects.
+ */
+static void evacuate_slab(struct sheep_vm *vm,
+			  struct sheep_cells *cells,
+			  struct sheep_slab **destp,
+			  struct sheep_slab *slab)
+{
+	unsigned long size = 1UL << slab->shift;
+	unsigned long word;
+
+	for (word = slab->first; word < slab->nr_words; word++) {
+		unsigned long live, bits;
+
+		live = bits = slab->alloc[word] & slab->marks[word];
+		while (bits) {
+			unsigned long bit = __builtin_ctzl(bits);
+			sheep_t old, new;
+
+			old = slab_object(slab, word, bit);
+			new = evacuation_cell(vm, cells, destp, slab->shift,
+					(slab->final[word] >> bit) & 1);
+			memcpy(new, old, size);
+			old->flags |= SHEEP_GC_FORWARDED;
+			*(sheep_t *)(old + 1) = new;
+
+			bits &= bits - 1;
+		}
+		slab->alloc[word] &= ~live;
+		slab->marks[word] &= ~live;
+		slab->final[word] &= ~live;
+		slab->nr_used -= __builtin_popcountl(live);
+		vm->gc_stats.nr_evacuated += __builtin_popcountl(live);
+	}
+	sweep_slab(vm, slab);
+}
+
+/* Take the sparse slabs out of the sweep queue of a size class */
+static unsigned long pick_sparse(struct sheep_cells *cells,
+				 struct sheep_slab **sparsep)
+{
+	struct sheep_slab **slabp, *slab;
+	unsigned long nr = 0;
+
+	for (slabp = &cells->unswept; (slab = *slabp);) {
+		if (!sparse(slab)) {
+			slabp = &slab->next;
+			continue;
+		}
+		*slabp = slab->next;
+		slab->next = *sparsep;
+		*sparsep = slab;
+		nr++;
+	}
+	return nr;
+}
+
+/*
+ * Evacuate sparse slabs of a size class into fresh ones, which hold
+ * nothing but live objects.  The emptied slabs are collected on
+ * @evacuated.
+ */
+static void evacuate(struct sheep_vm *vm,
+		     struct sheep_cells *cells,
+		     struct sheep_slab *slab,
+		     struct sheep_slab **evacuated)
+{
+	struct sheep_slab *next, *dest = NULL;
+
+	for (; slab; slab = next) {
+		next = slab->next;
+		evacuate_slab(vm, cells, &dest, slab);
+		slab->next = *evacuated;
+		*evacuated = slab;
+	}
+
+	if (!dest)
+		return;
+	if (dest->nr_used < slab_capacity(dest)) {
+		dest->next = cells->parts;
+		cells->parts = dest;
+	} else {
+		dest->next = cells->fulls;
+		cells->fulls = dest;
+	}
+}
+
+static void forward_roots(struct sheep_vector *roots,
+			  unsigned long start,
+			  unsigned long step)
+{
+	unsigned long i;
+
+	for (i = start; i < roots->nr_items; i += step)
+		roots->items[i] = sheep_forward(roots->items[i]);
+}
+
+static void forward_slabs(struct sheep_slab *slab)
+{
+	for (; slab; slab = slab->next) {
+		unsigned long word;
+
+		for (word = slab->first; word < slab->nr_words; word++) {
+			unsigned long bits;
+
+			bits = slab->alloc[word] & slab->marks[word];
+			while (bits) {
+				sheep_t sheep;
+
+				sheep = slab_object(slab, word, __builtin_ctzl(bits));
+				if (sheep->type->forward)
+					sheep->type->forward(sheep);
+				bits &= bits - 1;
+			}
+		}
+	}
+}
+
+/*
+ * Update every reference to an evacuated object: the exact roots and
+ * all live objects, which are all marked at this point.  Objects
+ * referenced from the native stack or protected never move.
+ */
+static void forward_all(struct sheep_vm *vm)
+{
+	struct sheep_large *large;
+	unsigned int i;
+
+	forward_roots(&vm->globals, 0, 1);
+	forward_roots(&vm->stack, 0, 1);
+	for (i = 0; i < vm->nr_frames; i++)
+		vm->frames[i].function = sheep_forward(vm->frames[i].function);
+	for (i = 0; i < SHEEP_NR_OPERATORS; i++)
+		vm->operators[i] = sheep_forward(vm->operators[i]);
+	forward_roots(&vm->old_weak, 0, 1);
+
+	for (i = 0; i < SHEEP_CELL_CLASSES; i++) {
+		forward_slabs(vm->cells[i].parts);
+		forward_slabs(vm->cells[i].fulls);
+		forward_slabs(vm->cells[i].unswept);
+	}
+	for (large = vm->old_large; large; large = large->next) {
+		sheep_t sheep = (sheep_t)(large + 1);
+
+		if (sheep->type->forward)
+			sheep->type->forward(sheep);
+	}
+}
+
+/*
+ * Rescan the roots, which are not covered by the write barrier,
+ * and mark whatever is still reachable.  If enough slabs turn out
+ * sparse, and all types allow, they are evacuated and returned to
+ * the system.  Updating the references takes a walk over the live
+ * heap, in the final pause.  Large objects are swept right away, the
+ * other slabs when allocation gets to them.
+ */
+static void finish_major(struct sheep_vm *vm)
+{
+	struct sheep_slab *sparse[SHEEP_CELL_CLASSES] = { NULL };
+	struct sheep_slab *evacuated = NULL;
+	struct sheep_large *young, *old;
+	unsigned long nr_sparse = 0;
+	int movable;
+	unsigned int i;
+
+	mark_roots(vm);
+	drain(vm, 0);
+	settle_weak(vm, 1);
+	vm->gc_marking = 0;
+
+	/* Everything live is old now */
+	forget_remembered(vm);
+
+	/* Region objects are not found by walking the cells */
+	movable = !vm->arena.depth && can_evacuate(vm);
+	for (i = 0; i < SHEEP_CELL_CLASSES; i++) {
+		struct sheep_cells *cells = &vm->cells[i];
+
+		defer_sweep(cells, cells->nursery);
+		defer_sweep(cells, cells->parts);
+		defer_sweep(cells, cells->fulls);
+		cells->nursery = cells->parts = cells->fulls = NULL;
+
+		if (movable)
+			nr_sparse += pick_sparse(cells, &sparse[i]);
+	}
+
+	if (nr_sparse < EVACUATE_MIN ||
+	    nr_sparse * EVACUATE_RATIO < vm->nr_slabs)
+		movable = 0;
+	for (i = 0; i < SHEEP_CELL_CLASSES; i++) {
+		if (movable)
+			evacuate(vm, &vm->cells[i], sparse[i], &evacuated);
+		else
+			defer_sweep(&vm->cells[i], sparse[i]);
+	}
+
+	young = vm->young_large;
+	old = vm->old_large;
+	vm->young_large = vm->old_large = NULL;
+	sweep_large(vm, young);
+	sweep_large(vm, old);
+
+	if (evacuated) {
+		struct sheep_slab *next;
+
+		forward_all(vm);
+		for (; evacuated; evacuated = next) {
+			next = evacuated->next;
+			release_slab(vm, evacuated);
+		}
+	}
+
+	vm->gc_live = vm->gc_old = vm->gc_marked;
+	set_target(vm);
+}
+
+static void step_major(struct sheep_vm *vm)
+{
+	unsigned long pause = vm->gc_policy.pause;
+
+	/* Finish up when allocation outruns the marker */
+	if (heap_size(vm) > 2 * vm->gc_target)
+		pause = 0;
+
+	if (drain(vm, pause))
+		finish_major(vm);
+}
+
+static void trace(struct sheep_vm *vm, const char *what, unsigned long pause)
+{
+	struct sheep_gc_stats *stats = &vm->gc_stats;
+
+	fprintf(stderr, "gc: %s #%lu: %luus, marked %zuk, old %zuk, "
+		"heap %zuk, target %zuk\n", what,
+		stats->nr_minor + stats->nr_major, pause,
+		vm->gc_marked >> 10, vm->gc_old >> 10,
+		heap_size(vm) >> 10, vm->gc_target >> 10);
+}
+
+/* Collect, and complete a full collection right away if @full */
+static void collect(struct sheep_vm *vm, int full)
+{
+	struct sheep_gc_stats *stats = &vm->gc_stats;
+	const char *what = "mark";
+	unsigned long start, pause;
+
+	start = now();
+	if (!vm->gc_marking) {
+		vm->gc_marked = 0;
+		collect_minor(vm);
+		vm->gc_old += vm->gc_marked;
+		stats->nr_minor++;
+		what = "minor";
+		if (full || vm->gc_old > vm->gc_target)
+			start_major(vm);
+	}
+	if (vm->gc_marking) {
+		if (full)
+			finish_major(vm);
+		else
+			step_major(vm);
+		if (!vm->gc_marking) {
+			stats->nr_major++;
+			what = "major";
+		}
+	}
+	vm->nr_young = 0;
+
+	pause = now() - start;
+	stats->total_pause += pause;
+	if (pause > stats->max_pause)
+		stats->max_pause = pause;
+	if (vm->gc_trace)
+		trace(vm, what, pause);
+}
+
+/*
+ * Find the next slab to allocate young cells of a size class from.
+ * Slabs left unswept by the last collection are swept here, one at
+ * a time, until one with free cells turns up.
+ */
+static void refill_nursery(struct sheep_vm *vm,
+			   struct sheep_cells *cells,
+			   unsigned int shift)
+{
+	struct sheep_slab *slab;
+
+	while ((slab = cells->unswept)) {
+		cells->unswept = slab->next;
+		sweep_slab(vm, slab);
+		if (slab->nr_used < slab_capacity(slab))
+			goto found;
+		slab->next = cells->fulls;
+		cells->fulls = slab;
+	}
+
+	if (cells->parts) {
+		slab = cells->parts;
+		cells->parts = slab->next;
+	} else
+		slab = new_slab(vm, shift);
+found:
+	slab->next = cells->nursery;
+	cells->nursery = slab;
+}
+
+static sheep_t nursery_alloc(struct sheep_vm *vm, unsigned int shift, int final)
+{
+	struct sheep_cells *cells;
+	sheep_t sheep;
+
+	cells = &vm->cells[shift - SHEEP_CELL_MIN_SHIFT];
+	while (!cells->nursery || !(sheep = alloc(cells->nursery, final)))
+		refill_nursery(vm, cells, shift);
+	return sheep;
+}
+
+/* A slab for the current region, recycling the spare ones first */
+static struct sheep_slab *arena_slab(struct sheep_vm *vm, unsigned int shift)
+{
+	struct sheep_arena *arena = &vm->arena;
+	struct sheep_slab *slab;
+
+	if (arena->spare) {
+		/* Spare slabs are kept with their bitmaps cleared */
+		slab = arena->spare;
+		arena->spare = slab->next;
+		arena->nr_spare--;
+		reset_slab(slab, shift);
+	} else
+		slab = new_slab(vm, shift);
+	slab->flags = SHEEP_SLAB_ARENA;
+	return slab;
+}
+
+static sheep_t arena_alloc(struct sheep_vm *vm, unsigned int shift, int final)
+{
+	struct sheep_slab **slabs;
+	sheep_t sheep;
+
+	slabs = &vm->arena.slabs[shift - SHEEP_CELL_MIN_SHIFT];
+	while (!*slabs || !(sheep = alloc(*slabs, final))) {
+		struct sheep_slab *slab = arena_slab(vm, shift);
+
+		slab->next = *slabs;
+		*slabs = slab;
+	}
+	return sheep;
+}
+
+static sheep_t alloc_large(struct sheep_vm *vm, size_t size)
+{
+	struct sheep_large *large;
+
+	large = sheep_malloc(sizeof(struct sheep_large) + size);
+	large->next = vm->young_large;
+	large->size = size;
+	large->marked = 0;
+	vm->young_large = large;
+	vm->large_size += size;
+	return (sheep_t)(large + 1);
+}
+
+/* Smallest size class fitting an object of @size bytes */
+static inline unsigned int cell_shift(size_t size)
+{
+	if (size <= 1UL << SHEEP_CELL_MIN_SHIFT)
+		return SHEEP_CELL_MIN_SHIFT;
+	return SHEEP_BITS_PER_LONG - __builtin_clzl(size - 1);
+}
+
+/* Find the statistics slot of a type, -1 if the table is full */
+static int type_slot(struct sheep_gc_stats *stats, const struct sheep_type *type)
+{
+	unsigned int i, slot;
+
+	slot = ((unsigned long)type / sizeof(long)) % SHEEP_GC_TYPES;
+	for (i = 0; i < SHEEP_GC_TYPES; i++) {
+		if (stats->types[slot] == type)
+			return slot;
+		if (!stats->types[slot]) {
+			stats->types[slot] = type;
+			return slot;
+		}
+		slot = (slot + 1) % SHEEP_GC_TYPES;
+	}
+	return -1;
+}
+
+/* Allocate an object, the caller checked for a collection */
+static sheep_t alloc_object(struct sheep_vm *vm,
+			    const struct sheep_type *type,
+			    size_t size)
+{
+	sheep_t sheep;
+	int slot;
+
+	slot = type_slot(&vm->gc_stats, type);
+	if (slot >= 0)
+		vm->gc_stats.nr_allocated[slot]++;
+
+	size += sizeof(struct sheep_object);
+	if (size > 1UL << SHEEP_CELL_MAX_SHIFT) {
+		sheep = alloc_large(vm, size);
+		sheep->flags = SHEEP_GC_HEAP | SHEEP_GC_LARGE;
+		if (vm->arena.depth)
+			__sheep_gc_escape(vm, sheep, NULL);
+	} else if (vm->arena.depth && !type->weak) {
+		sheep = arena_alloc(vm, cell_shift(size),
+				type->free || type->release);
+		sheep->flags = SHEEP_GC_HEAP;
+		/* Nothing to collect, the region goes away as a whole */
+		size = 0;
+	} else {
+		unsigned int shift = cell_shift(size);
+
+		sheep = nursery_alloc(vm, shift, type->free || type->release);
+		sheep->flags = SHEEP_GC_HEAP;
+		size = 1UL << shift;
+	}
+	sheep->type = type;
+
+	if (vm->gc_marking) {
+		if (type->mark)
+			push_gray(&vm->gray, sheep);
+		else
+			test_and_mark(vm, sheep);
+	}
+
+	vm->nr_young += size;
+	return sheep;
+}
+
+/**
+ * sheep_gc_alloc - allocate an object
+ * @vm: runtime
+ * @type: type of the object
+ * @size: size of the inline payload
+ *
+ * The payload is not initialized and has to be set up before the
+ * next allocation, which might trigger a collection.
+ *
+ * Objects allocated while marking is in progress are shaded right
+ * away, they are marked and scanned by a later slice.
+ */
+struct sheep_object *sheep_gc_alloc(struct sheep_vm *vm,
+				    const struct sheep_type *type,
+				    size_t size)
+{
+	if (vm->nr_young >= vm->gc_budget && !vm->gc_disabled)
+		collect(vm, 0);
+	return alloc_object(vm, type, size);
+}
+
+/**
+ * sheep_gc_alloc_n - allocate a chain of objects
+ * @vm: runtime
+ * @type: type of the objects
+ * @size: size of the inline payload of each object
+ * @nr: number of objects, at least one
+ * @link: offset of the pointer to the next object in the payload
+ *
+ * Allocates @nr objects in one go, collecting at most once before
+ * the first one, and links each object to the next through the
+ * pointer at @link in its payload, the last one to NULL.  Only the
+ * first object needs to be kept alive while the rest of the payloads
+ * are set up, given the type's mark callback follows the link.
+ *
+ * Small objects come from consecutive cells of the current slab for
+ * as long as it has room.
+ *
+ * Returns the first object of the chain.
+ */
+struct sheep_object *sheep_gc_alloc_n(struct sheep_vm *vm,
+				      const struct sheep_type *type,
+				      size_t size, unsigned long nr,
+				      size_t link)
+{
+	sheep_t first, prev;
+
+	if (vm->nr_young >= vm->gc_budget && !vm->gc_disabled)
+		collect(vm, 0);
+
+	first = prev = alloc_object(vm, type, size);
+	while (--nr) {
+		sheep_t sheep = alloc_object(vm, type, size);
+
+		*(sheep_t *)((char *)sheep_data(prev) + link) = sheep;
+		prev = sheep;
+	}
+	*(sheep_t *)((char *)sheep_data(prev) + link) = NULL;
+	return first;
+}
+
+/*
+ * Objects are only queued here, the mark bit is tested and set when
+ * they come off the gray stack.  This keeps the marker from touching
+ * an object right after finding a reference to it.
+ */
+void sheep_mark(sheep_t sheep)
+{
+	if (!sheep || sheep_is_fixnum(sheep))
+		return;
+	push_gray(gray, sheep);
+}
+
+void __sheep_gc_shade(struct sheep_vm *vm, sheep_t sheep)
+{
+	if (sheep->type->mark)
+		push_gray(&vm->gray, sheep);
+	else
+		test_and_mark(vm, sheep);
+}
+
+/**
+ * sheep_gc_weak - register an object holding weak references
+ * @vm: runtime
+ * @sheep: new object of a type with a weak hook
+ *
+ * The collector settles the weak references of registered objects
+ * whenever it has found them alive, see struct sheep_type.
+ */
+void sheep_gc_weak(struct sheep_vm *vm, sheep_t sheep)
+{
+	sheep_vector_push(&vm->young_weak, sheep);
+}
+
+void sheep_protect(struct sheep_vm *vm, sheep_t sheep)
+{
+	sheep_vector_push(&vm->protected, sheep);
+}
+
+void sheep_unprotect(struct sheep_vm *vm, sheep_t sheep)
+{
+	sheep_t prot;
+
+	prot = sheep_vector_pop(&vm->protected);
+	sheep_bug_on(prot != sheep);
+}
+
+/**
+ * sheep_gc_arena_enter - enter an allocation region
+ * @vm: runtime
+ *
+ * Objects allocated from now on until sheep_gc_arena_exit() go into
+ * a region of their own, which is discarded wholesale on exit,
+ * without collecting.  Only the result and what is reachable from
+ * outside of the region survive it, see sheep_gc_arena_exit().
+ * Weak references and large objects are allocated outside of the
+ * region.
+ *
+ * Regions do not nest, inner enters and exits are merely counted.
+ */
+void sheep_gc_arena_enter(struct sheep_vm *vm)
+{
+	if (!vm->arena.depth++)
+		vm->arena.remembered = vm->remembered.nr_items;
+}
+
+/**
+ * __sheep_gc_escape - record a reference into the current region
+ * @vm: runtime
+ * @object: object outside of the region holding the reference
+ * @value: the region object stored, NULL to check all of @object's
+ *         references when the region is left
+ */
+void __sheep_gc_escape(struct sheep_vm *vm, sheep_t object, sheep_t value)
+{
+	sheep_vector_push(&vm->arena.escapes, object);
+	sheep_vector_push(&vm->arena.escapes, value);
+}
+
+void __sheep_gc_escape_global(struct sheep_vm *vm, unsigned int slot)
+{
+	sheep_vector_push(&vm->arena.globals, (void *)(unsigned long)slot);
+}
+
+/*
+ * Flag a region object as surviving the region.  Pinned objects stay
+ * where they are and keep their slab, the others are moved out.
+ */
+static void escape(struct sheep_vector *escaped, sheep_t sheep, int pin)
+{
+	if (!sheep_gc_arena_object(sheep))
+		return;
+	if (pin)
+		sheep_slab(sheep)->flags |= SHEEP_SLAB_ESCAPED;
+	if (sheep->flags & SHEEP_GC_ESCAPED)
+		return;
+	sheep->flags |= SHEEP_GC_ESCAPED;
+	sheep_vector_push(escaped, sheep);
+}
+
+/* Escape the region objects @sheep refers to */
+static void escape_children(struct sheep_vector *escaped, sheep_t sheep)
+{
+	struct sheep_vector *children = gray;
+
+	if (!sheep->type->mark)
+		return;
+	sheep->type->mark(sheep);
+	while (children->nr_items)
+		escape(escaped, sheep_vector_pop(children), 0);
+}
+
+/*
+ * Find everything that survives the region: the result, whatever
+ * the stack below @scope and variables captured by closures refer
+ * to, the region objects the write barrier recorded in globals and
+ * other objects, and all that these reach within the region.  Objects
+ * allocated outside of the region while it was active were not
+ * covered by the barrier on initialization, their references are
+ * checked here.  Protected objects are pinned, native code holds
+ * their addresses, and so is everything if not all types can update
+ * their references.
+ */
+static void find_escapes(struct sheep_vm *vm, sheep_t result,
+			 unsigned long scope, struct sheep_vector *escaped)
+{
+	struct sheep_arena *arena = &vm->arena;
+	struct sheep_vector *escapes = &arena->escapes;
+	struct sheep_vector children = { 0 };
+	struct sheep_indirect *indirect;
+	unsigned long i;
+
+	gray = &children;
+
+	for (i = 0; i < vm->protected.nr_items; i++)
+		escape(escaped, vm->protected.items[i], 1);
+	escape(escaped, result, 0);
+	for (i = 0; i < scope && i < vm->stack.nr_items; i++)
+		escape(escaped, vm->stack.items[i], 0);
+	for (i = 0; i < arena->globals.nr_items; i++) {
+		unsigned long slot = (unsigned long)arena->globals.items[i];
+
+		escape(escaped, vm->globals.items[slot], 0);
+	}
+	for (indirect = vm->pending; indirect;
+	     indirect = indirect->value.live.next)
+		escape(escaped, vm->stack.items[indirect->value.live.index], 0);
+
+	for (i = 0; i < escapes->nr_items; i += 2) {
+		if (escapes->items[i + 1])
+			escape(escaped, escapes->items[i + 1], 0);
+		else
+			escape_children(escaped, escapes->items[i]);
+	}
+	for (i = 0; i < escaped->nr_items; i++)
+		escape_children(escaped, escaped->items[i]);
+
+	gray = &vm->gray;
+	sheep_free(children.items);
+
+	if (escaped->nr_items && !can_evacuate(vm))
+		for (i = 0; i < escaped->nr_items; i++)
+			escape(escaped, escaped->items[i], 1);
+}
+
+static inline int discarded(sheep_t sheep)
+{
+	return sheep_gc_arena_object(sheep) &&
+		!(sheep->flags & SHEEP_GC_ESCAPED);
+}
+
+/* Clear the stack slots from @scope on that refer to discarded objects */
+static void drop_stack(struct sheep_vector *stack, unsigned long scope)
+{
+	unsigned long i;
+
+	for (i = scope; i < stack->nr_items; i++)
+		if (discarded(stack->items[i]))
+			stack->items[i] = NULL;
+}
+
+/* Remove discarded objects from a collector queue, from @start on */
+static void drop_discarded(struct sheep_vector *vector, unsigned long start)
+{
+	unsigned long i, nr = start;
+
+	for (i = start; i < vector->nr_items; i++)
+		if (!discarded(vector->items[i]))
+			vector->items[nr++] = vector->items[i];
+	vector->nr_items = nr;
+}
+
+/*
+ * Move an escaped object out of its region slab into the nursery,
+ * leaving the forwarding address behind.  Old objects stay old, and
+ * the finalization duty moves along.
+ */
+static void move_escaped(struct sheep_vm *vm, sheep_t old)
+{
+	struct sheep_slab *slab = sheep_slab(old);
+	unsigned long index = sheep_slab_index(old);
+	unsigned long word = index / SHEEP_BITS_PER_LONG;
+	unsigned long bit = 1UL << (index % SHEEP_BITS_PER_LONG);
+	unsigned long size = 1UL << slab->shift;
+	sheep_t new;
+
+	new = nursery_alloc(vm, slab->shift, !!(slab->final[word] & bit));
+	memcpy(new, old, size);
+	new->flags &= ~SHEEP_GC_ESCAPED;
+
+	if (slab->marks[word] & bit) {
+		index = sheep_slab_index(new);
+		sheep_slab(new)->marks[index / SHEEP_BITS_PER_LONG] |=
+			1UL << (index % SHEEP_BITS_PER_LONG);
+	} else
+		vm->nr_young += size;
+
+	slab->final[word] &= ~bit;
+	old->flags |= SHEEP_GC_FORWARDED;
+	*(sheep_t *)(old + 1) = new;
+}
+
+/*
+ * Update every reference to a moved object.  Outside of the region,
+ * only the stack, the collector queues, and the globals and objects
+ * the barrier recorded can hold one.
+ */
+static void forward_escaped(struct sheep_vm *vm, struct sheep_vector *escaped)
+{
+	struct sheep_arena *arena = &vm->arena;
+	struct sheep_vector *escapes = &arena->escapes;
+	unsigned long i;
+
+	for (i = 0; i < arena->globals.nr_items; i++) {
+		unsigned long slot = (unsigned long)arena->globals.items[i];
+
+		vm->globals.items[slot] = sheep_forward(vm->globals.items[slot]);
+	}
+	forward_roots(&vm->stack, 0, 1);
+	forward_roots(&vm->remembered, arena->remembered, 1);
+	forward_roots(&vm->gray, 0, 1);
+
+	for (i = 0; i < escapes->nr_items; i += 2) {
+		sheep_t sheep = escapes->items[i];
+
+		if (sheep->type->forward)
+			sheep->type->forward(sheep);
+	}
+	for (i = 0; i < escaped->nr_items; i++) {
+		sheep_t sheep = sheep_forward(escaped->items[i]);
+
+		if (sheep->type->forward)
+			sheep->type->forward(sheep);
+	}
+}
+
+/*
+ * Free the cells of a region slab with pinned objects, except for
+ * those that escaped, and hand the slab over to the nursery, where
+ * the survivors are young or old just like the other objects there.
+ */
+static void adopt_slab(struct sheep_vm *vm, struct sheep_cells *cells,
+		       struct sheep_slab *slab, struct release_batch **batchp)
+{
+	unsigned long word;
+
+	for (word = slab->first; word < slab->nr_words; word++) {
+		unsigned long bits = slab->alloc[word], dead = 0;
+
+		while (bits) {
+			unsigned long bit = __builtin_ctzl(bits);
+			sheep_t sheep = slab_object(slab, word, bit);
+
+			if (sheep->flags & SHEEP_GC_ESCAPED)
+				sheep->flags &= ~SHEEP_GC_ESCAPED;
+			else
+				dead |= 1UL << bit;
+			bits &= bits - 1;
+		}
+		if (!dead)
+			continue;
+		slab->marks[word] &= ~dead;
+		free_cells(vm, slab, word, dead, batchp);
+	}
+	slab->flags &= ~(SHEEP_SLAB_ARENA | SHEEP_SLAB_ESCAPED);
+	slab->cursor = slab->first;
+
+	/* Behind the slab currently allocated from */
+	if (cells->nursery) {
+		slab->next = cells->nursery->next;
+		cells->nursery->next = slab;
+	} else {
+		slab->next = NULL;
+		cells->nursery = slab;
+	}
+}
+
+/*
+ * Finalize the objects left in a region slab and keep it for the
+ * next region.  Region slabs are only ever allocated up to the
+ * cursor, which bounds the bitmap words to clear.
+ */
+static void discard_slab(struct sheep_vm *vm, struct sheep_slab *slab,
+			 struct release_batch **batchp)
+{
+	struct sheep_arena *arena = &vm->arena;
+	unsigned long word, end;
+
+	end = slab->cursor < slab->nr_words ? slab->cursor + 1 : slab->nr_words;
+	for (word = slab->first; word < end; word++)
+		if (slab->final[word])
+			free_cells(vm, slab, word, slab->alloc[word], batchp);
+
+	if (arena->nr_spare >= ARENA_SLABS) {
+		release_slab(vm, slab);
+		return;
+	}
+	memset(slab->alloc, 0, end * sizeof(unsigned long));
+	memset(slab->marks, 0, end * sizeof(unsigned long));
+	memset(slab->final, 0, end * sizeof(unsigned long));
+	slab->next = arena->spare;
+	arena->spare = slab;
+	arena->nr_spare++;
+}
+
+/* Nothing was allocated into the region? */
+static int arena_empty(struct sheep_arena *arena)
+{
+	unsigned int i;
+
+	for (i = 0; i < SHEEP_CELL_CLASSES; i++)
+		if (arena->slabs[i])
+			return 0;
+	return 1;
+}
+
+/**
+ * sheep_gc_arena_exit - leave an allocation region
+ * @vm: runtime
+ * @result: the value the region produced
+ * @scope: first stack slot private to the region
+ *
+ * Discards all objects of the region, except for @result and what
+ * escaped the region through the globals, the stack below @scope,
+ * closures, protected objects, or other objects.  Stack slots from
+ * @scope on referring to discarded objects are cleared, pass the
+ * stack size to keep the whole stack.
+ *
+ * The survivors are moved out to the main heap, unless some types
+ * can not update their references or the object is protected, in
+ * which case they stay in place and their slab joins the heap.
+ * References held only by native code are not seen, they are stale
+ * when this returns.
+ *
+ * An error unwinding the evaluator to the top level leaves all
+ * regions, later exits are ignored.
+ *
+ * Returns the new location of @result.
+ */
+sheep_t sheep_gc_arena_exit(struct sheep_vm *vm, sheep_t result,
+			    unsigned long scope)
+{
+	struct sheep_arena *arena = &vm->arena;
+	struct sheep_vector escaped = { 0 };
+	unsigned long i, nr_moved = 0;
+
+	if (!arena->depth || --arena->depth)
+		return result;
+	if (arena_empty(arena))
+		goto out;
+
+	find_escapes(vm, result, scope, &escaped);
+
+	drop_stack(&vm->stack, scope);
+	drop_discarded(&vm->remembered, arena->remembered);
+	drop_discarded(&vm->gray, 0);
+
+	for (i = 0; i < escaped.nr_items; i++) {
+		sheep_t sheep = escaped.items[i];
+
+		if (sheep_slab(sheep)->flags & SHEEP_SLAB_ESCAPED)
+			continue;
+		move_escaped(vm, sheep);
+		nr_moved++;
+	}
+	if (nr_moved)
+		forward_escaped(vm, &escaped);
+	result = sheep_forward(result);
+
+	for (i = 0; i < SHEEP_CELL_CLASSES; i++) {
+		struct sheep_slab *slab, *next;
+
+		for (slab = arena->slabs[i]; slab; slab = next) {
+			next = slab->next;
+			if (slab->flags & SHEEP_SLAB_ESCAPED)
+				adopt_slab(vm, &vm->cells[i], slab,
+					&arena->batch);
+			else
+				discard_slab(vm, slab, &arena->batch);
+		}
+		arena->slabs[i] = NULL;
+	}
+
+	/* Small regions would wake the finalizer thread all the time */
+	if (arena->batch && arena->batch->nr_bytes >= RELEASE_BATCH) {
+		submit_release(vm, arena->batch);
+		arena->batch = NULL;
+	}
+	sheep_free(escaped.items);
+out:
+	arena->escapes.nr_items = 0;
+	arena->globals.nr_items = 0;
+	return result;
+}
+
+/* Byte count with an optional k, m or g suffix */
+static size_t parse_size(const char *str)
+{
+	size_t size;
+	char *end;
+
+	size = strtoul(str, &end, 0);
+	switch (*end) {
+	case 'g':
+	case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'm':
+	case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'k':
+	case 'K':
+		size <<= 10;
+	}
+	return size;
+}
+
+/**
+ * sheep_gc_tune - change the heap growth policy
+ * @vm: runtime
+ * @policy: the new policy
+ *
+ * Growth factors below 100% are raised to 100%, the heap would
+ * otherwise never be allowed to hold all its live data.
+ */
+void sheep_gc_tune(struct sheep_vm *vm, const struct sheep_gc_policy *policy)
+{
+	if (policy->threads != vm->gc_policy.threads)
+		stop_markers(vm);
+
+	vm->gc_policy = *policy;
+	if (vm->gc_policy.growth < 100)
+		vm->gc_policy.growth = 100;
+	if (vm->gc_policy.threads < 1)
+		vm->gc_policy.threads = 1;
+	if (vm->gc_policy.threads > MAX_THREADS)
+		vm->gc_policy.threads = MAX_THREADS;
+	set_target(vm);
+}
+
+/*
+ * The environment, if set, overrides the policy passed in by the
+ * embedding application, which overrides the defaults.
+ */
+void sheep_gc_init(struct sheep_vm *vm, const struct sheep_gc_policy *policy)
+{
+	struct sheep_gc_policy init = {
+		.growth = DEFAULT_GROWTH,
+		.min_heap = DEFAULT_MIN_HEAP,
+		.pause = DEFAULT_PAUSE,
+		.threads = DEFAULT_THREADS,
+	};
+	const char *env;
+
+	if (!page_size)
+		page_size = sysconf(_SC_PAGESIZE);
+	if (policy)
+		init = *policy;
+
+	env = getenv("SHEEP_GC_GROWTH");
+	if (env)
+		init.growth = strtoul(env, NULL, 0);
+	env = getenv("SHEEP_GC_MIN_HEAP");
+	if (env)
+		init.min_heap = parse_size(env);
+	env = getenv("SHEEP_GC_PAUSE");
+	if (env)
+		init.pause = strtoul(env, NULL, 0);
+	env = getenv("SHEEP_GC_THREADS");
+	if (env)
+		init.threads = strtoul(env, NULL, 0);
+	env = getenv("SHEEP_GC_TRACE");
+	vm->gc_trace = env && *env && strcmp(env, "0");
+
+	sheep_gc_tune(vm, &init);
+}
+
+/*
+ * (gc-policy [growth-percent minimum-heap-bytes pause-microseconds
+ *             [marker-threads]])
+ */
+static sheep_t builtin_gc_policy(struct sheep_vm *vm, unsigned int nr_args)
+{
+	if (nr_args) {
+		struct sheep_gc_policy policy;
+		long growth, min_heap, pause;
+		long threads = vm->gc_policy.threads;
+
+		if (sheep_unpack_stack(vm, nr_args,
+				       nr_args == 3 ? "NNN" : "NNNN",
+				       &growth, &min_heap, &pause, &threads))
+			return NULL;
+		if (growth < 0 || min_heap < 0 || pause < 0 || threads < 0) {
+			sheep_error(vm, "negative growth policy");
+			return NULL;
+		}
+		policy.growth = growth;
+		policy.min_heap = min_heap;
+		policy.pause = pause;
+		policy.threads = threads;
+		sheep_gc_tune(vm, &policy);
+	}
+
+	return sheep_make_list(vm, 4,
+			sheep_make_number(vm, vm->gc_policy.growth),
+			sheep_make_number(vm, vm->gc_policy.min_heap),
+			sheep_make_number(vm, vm->gc_policy.pause),
+			sheep_make_number(vm, vm->gc_policy.threads));
+}
+
+/*
+ * Count the live objects of a slab list per type.  Cells of unswept
+ * slabs are live only if they are marked.
+ */
+static void count_slabs(struct sheep_vm *vm, struct sheep_slab *slab,
+			int unswept, unsigned long *live)
+{
+	for (; slab; slab = slab->next) {
+		unsigned long word;
+
+		for (word = slab->first; word < slab->nr_words; word++) {
+			unsigned long bits = slab->alloc[word];
+
+			if (unswept)
+				bits &= slab->marks[word];
+			while (bits) {
+				sheep_t sheep;
+				int slot;
+
+				sheep = slab_object(slab, word, __builtin_ctzl(bits));
+				slot = type_slot(&vm->gc_stats, sheep->type);
+				if (slot >= 0)
+					live[slot]++;
+				bits &= bits - 1;
+			}
+		}
+	}
+}
+
+static void count_large(struct sheep_vm *vm, struct sheep_large *large,
+			unsigned long *live)
+{
+	for (; large; large = large->next) {
+		sheep_t sheep = (sheep_t)(large + 1);
+		int slot;
+
+		slot = type_slot(&vm->gc_stats, sheep->type);
+		if (slot >= 0)
+			live[slot]++;
+	}
+}
+
+/* ((type-name live freed) ...), freed counting everything not live */
+static sheep_t make_type_stats(struct sheep_vm *vm)
+{
+	struct sheep_gc_stats *stats = &vm->gc_stats;
+	unsigned long live[SHEEP_GC_TYPES] = { 0 };
+	sheep_t list;
+	unsigned int i;
+
+	for (i = 0; i < SHEEP_CELL_CLASSES; i++) {
+		count_slabs(vm, vm->cells[i].nursery, 0, live);
+		count_slabs(vm, vm->cells[i].parts, 0, live);
+		count_slabs(vm, vm->cells[i].fulls, 0, live);
+		count_slabs(vm, vm->cells[i].unswept, 1, live);
+		count_slabs(vm, vm->arena.slabs[i], 0, live);
+	}
+	count_large(vm, vm->young_large, live);
+	count_large(vm, vm->old_large, live);
+
+	list = sheep_make_cons(vm, NULL, NULL);
+	for (i = 0; i < SHEEP_GC_TYPES; i++) {
+		sheep_t name, entry;
+
+		if (!stats->types[i])
+			continue;
+
+		name = sheep_make_string(vm, stats->types[i]->name);
+		entry = sheep_make_list(vm, 3, name,
+				sheep_make_number(vm, live[i]),
+				sheep_make_number(vm,
+					stats->nr_allocated[i] - live[i]));
+		list = sheep_make_cons(vm, entry, list);
+	}
+	return list;
+}
+
+/*
+ * (gc-stats) => (collections total-pause max-pause
+ *                ((type-name live freed) ...)
+ *                slabs-allocated slabs-released large-bytes
+ *                evacuated cache-bytes cache-chunk-bytes)
+ *
+ * Pauses are in microseconds.  Object payloads are allocated inline,
+ * only large objects are allocated with malloc().  The cache bytes
+ * are those of the vm's internal structures outstanding, and the
+ * chunks they are carved from, see struct sheep_cache.
+ */
+static sheep_t builtin_gc_stats(struct sheep_vm *vm, unsigned int nr_args)
+{
+	struct sheep_gc_stats *stats = &vm->gc_stats;
+	sheep_t types;
+
+	if (sheep_unpack_stack(vm, nr_args, ""))
+		return NULL;
+
+	types = make_type_stats(vm);
+	return sheep_make_list(vm, 10,
+			sheep_make_number(vm, stats->nr_minor + stats->nr_major),
+			sheep_make_number(vm, stats->total_pause),
+			sheep_make_number(vm, stats->max_pause),
+			types,
+			sheep_make_number(vm, stats->nr_slabs_allocated),
+			sheep_make_number(vm, stats->nr_slabs_released),
+			sheep_make_number(vm, vm->large_size),
+			sheep_make_number(vm, stats->nr_evacuated),
+			sheep_make_number(vm, vm->cache.nr_bytes),
+			sheep_make_number(vm, vm->cache.nr_chunk_bytes));
+}
+
+/* (gc) */
+static sheep_t builtin_gc(struct sheep_vm *vm, unsigned int nr_args)
+{
+	if (!vm->gc_disabled)
+		collect(vm, 1);
+	return &sheep_nil;
+}
+
+void sheep_gc_builtins(struct sheep_vm *vm)
+{
+	sheep_vm_function_sig(vm, "gc", builtin_gc, "");
+	sheep_vm_function(vm, "gc-policy", builtin_gc_policy);
+	sheep_vm_function(vm, "gc-stats", builtin_gc_stats);
+}
+
+static void drain_slabs(struct sheep_vm *vm, struct sheep_slab *slab)
+{
+	struct sheep_slab *next;
+
+	for (; slab; slab = next) {
+		next = slab->next;
+		memset(slab->marks, 0, sizeof(slab->marks));
+		sweep_slab(vm, slab);
+		free_slab(vm, slab);
+	}
+}
+
+void sheep_gc_exit(struct sheep_vm *vm)
+{
+	unsigned int i;
 
 	sheep_free(vm->protected.items);
-	while (vm->parts) {
-		next = vm->parts->next;
-		drain_pool(vm, vm->parts);
-		free_pool(vm->parts);
-		vm->parts = next;
-	}
-	while (vm->fulls) {
-		next = vm->fulls->next;
-		drain_pool(vm, vm->fulls);
-		free_pool(vm->fulls);
-		vm->fulls = next;
+	sheep_free(vm->remembered.items);
+	sheep_free(vm->gray.items);
+	sheep_free(vm->young_weak.items);
+	sheep_free(vm->old_weak.items);
+	sheep_free(vm->arena.escapes.items);
+	sheep_free(vm->arena.globals.items);
+	for (i = 0; i < SHEEP_CELL_CLASSES; i++) {
+		drain_slabs(vm, vm->cells[i].nursery);
+		drain_slabs(vm, vm->cells[i].parts);
+		drain_slabs(vm, vm->cells[i].fulls);
+		drain_slabs(vm, vm->cells[i].unswept);
+		drain_slabs(vm, vm->arena.slabs[i]);
 	}
+	drain_slabs(vm, vm->arena.spare);
+	drain_slabs(vm, vm->empty);
+	if (vm->arena.batch)
+		submit_release(vm, vm->arena.batch);
+	unmark_large(vm->young_large);
+	unmark_large(vm->old_large);
+	sweep_large(vm, vm->young_large);
+	sweep_large(vm, vm->old_large);
+	stop_finalizer(vm);
+	stop_markers(vm);
 }
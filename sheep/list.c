@@ -21,22 +21,26 @@ static void list_mark(sheep_t sheep)
 	struct sheep_list *list;
 
 	list = sheep_list(sheep);
-	if (!list->head)
-		return;
-	sheep_mark(list->head);
 	/*
 	 * Usually, list->head and list->tail are both NULL or both
 	 * set.  But to facilitate simpler, non-atomic construction
 	 * sites, handle garbage collection cycles between setting the
-	 * head and setting the tail.
+	 * head and setting the tail, and lists that are allocated in
+	 * one go and filled in later, see sheep_make_conses().
 	 */
+	if (list->head)
+		sheep_mark(list->head);
 	if (list->tail)
 		sheep_mark(list->tail);
 }
 
-static void list_free(struct sheep_vm *vm, sheep_t sheep)
+static void list_forward(sheep_t sheep)
 {
-	sheep_free(sheep_list(sheep));
+	struct sheep_list *list;
+
+	list = sheep_list(sheep);
+	list->head = sheep_forward(list->head);
+	list->tail = sheep_forward(list->tail);
 }
 
 static int list_test(sheep_t sheep)
@@ -92,12 +96,9 @@ static sheep_t do_list_concat(struct sheep_vm *vm, sheep_t base, sheep_t tail)
 	struct sheep_list *pos;
 
 	for (pos = sheep_list(tail); pos->head; pos = sheep_list(pos->tail)) {
-		struct sheep_list *node;
-
-		node = sheep_list(base);
-		node->head = pos->head;
-		node->tail = sheep_make_cons(vm, NULL, NULL);
-		base = node->tail;
+		sheep_list_set_head(vm, base, pos->head);
+		sheep_list_set_tail(vm, base, sheep_make_cons(vm, NULL, NULL));
+		base = sheep_list(base)->tail;
 	}
 	return base;
 }
@@ -109,10 +110,7 @@ static sheep_t list_concat(struct sheep_vm *vm,
 	sheep_t start, pos, result = NULL;
 	unsigned int i;
 
-	sheep_protect(vm, sheep);
-
 	start = sheep_make_cons(vm, NULL, NULL);
-	sheep_protect(vm, start);
 
 	pos = do_list_concat(vm, start, sheep);
 	for (i = 1; i < nr_args; i++) {
@@ -127,37 +125,29 @@ static sheep_t list_concat(struct sheep_vm *vm,
 	vm->stack.nr_items -= nr_args;
 	result = start;
 out:
-	sheep_unprotect(vm, start);
-	sheep_unprotect(vm, sheep);
-
 	return result;
 }
 
 static sheep_t list_reverse(struct sheep_vm *vm, sheep_t sheep)
 {
+	sheep_t new, pos, prev, next;
 	struct sheep_list *old;
-	sheep_t new;
+	size_t nr;
 
-	sheep_protect(vm, sheep);
-
-	new = sheep_make_cons(vm, NULL, NULL);
-	sheep_protect(vm, new);
+	nr = list_length(sheep);
+	new = pos = sheep_make_conses(vm, nr);
 
+	/* Copy the items in order, then turn the links around */
 	for (old = sheep_list(sheep); old->head; old = sheep_list(old->tail)) {
-		sheep_t new_head;
-
-		new_head = sheep_make_cons(vm, old->head, new);
-
-		sheep_unprotect(vm, new);
-		sheep_protect(vm, new_head);
-
-		new = new_head;
+		sheep_list(pos)->head = old->head;
+		pos = sheep_list(pos)->tail;
 	}
-
-	sheep_unprotect(vm, new);
-	sheep_unprotect(vm, sheep);
-
-	return new;
+	for (prev = pos; new != pos; new = next) {
+		next = sheep_list(new)->tail;
+		sheep_list(new)->tail = prev;
+		prev = new;
+	}
+	return prev;
 }
 
 static sheep_t list_nth(struct sheep_vm *vm, size_t n, sheep_t sheep)
@@ -179,37 +169,28 @@ static sheep_t list_slice(struct sheep_vm *vm,
 			  size_t from,
 			  size_t to)
 {
-	struct sheep_list *list, *pos;
-	sheep_t new, result = NULL;
+	struct sheep_list *list, *start = NULL;
 	size_t index = 0;
-
-	sheep_protect(vm, sheep);
-
-	new = sheep_make_cons(vm, NULL, NULL);
-	sheep_protect(vm, new);
+	sheep_t new, pos;
 
 	list = sheep_list(sheep);
-	pos = sheep_list(new);
-
 	while (index < to && list->head) {
-		if (index >= from) {
-			pos->head = list->head;
-			pos->tail = sheep_make_cons(vm, NULL, NULL);
-			pos = sheep_list(pos->tail);
-		}
+		if (index == from)
+			start = list;
 		list = sheep_list(list->tail);
 		index++;
-
 	}
-	if (index == to)
-		result = new;
-	else
+	if (index < to) {
 		sheep_error(vm, "index %ld out of range [0, %ld)", to, index);
+		return NULL;
+	}
 
-	sheep_unprotect(vm, new);
-	sheep_unprotect(vm, sheep);
-
-	return result;
+	new = pos = sheep_make_conses(vm, to - from);
+	for (list = start; index-- > from; list = sheep_list(list->tail)) {
+		sheep_list(pos)->head = list->head;
+		pos = sheep_list(pos)->tail;
+	}
+	return new;
 }
 
 static sheep_t list_position(struct sheep_vm *vm, sheep_t item, sheep_t sheep)
@@ -240,7 +221,7 @@ static const struct sheep_sequence list_sequence = {
 const struct sheep_type sheep_list_type = {
 	.name = "list",
 	.mark = list_mark,
-	.free = list_free,
+	.forward = list_forward,
 	.compile = sheep_compile_list,
 	.test = list_test,
 	.equal = list_equal,
@@ -251,33 +232,55 @@ const struct sheep_type sheep_list_type = {
 sheep_t sheep_make_cons(struct sheep_vm *vm, sheep_t head, sheep_t tail)
 {
 	struct sheep_list *list;
+	sheep_t sheep;
 
-	list = sheep_malloc(sizeof(struct sheep_list));
+	sheep = sheep_make_object(vm, &sheep_list_type,
+				sizeof(struct sheep_list));
+	list = sheep_list(sheep);
 	list->head = head;
 	list->tail = tail;
-	return sheep_make_object(vm, &sheep_list_type, list);
+	return sheep;
+}
+
+/**
+ * sheep_make_conses - allocate a list to fill in
+ * @vm: runtime
+ * @nr: number of items
+ *
+ * Allocates the @nr cells of a list and the empty list terminating
+ * it in one go, see sheep_gc_alloc_n().  The cells are linked up
+ * but their heads are empty, so the list appears to end at the
+ * first cell not yet filled in.
+ *
+ * Fresh cells may be filled in directly, the write barrier is only
+ * needed once other objects were allocated in the meantime.
+ */
+sheep_t sheep_make_conses(struct sheep_vm *vm, size_t nr)
+{
+	sheep_t list, pos;
+
+	list = sheep_gc_alloc_n(vm, &sheep_list_type,
+				sizeof(struct sheep_list), nr + 1,
+				offsetof(struct sheep_list, tail));
+	for (pos = list; pos; pos = sheep_list(pos)->tail)
+		sheep_list(pos)->head = NULL;
+	return list;
 }
 
 sheep_t sheep_make_list(struct sheep_vm *vm, unsigned int nr, ...)
 {
-	struct sheep_list *p;
-	sheep_t list;
+	sheep_t list, pos;
 	va_list ap;
 
-	list = sheep_make_cons(vm, NULL, NULL);
-	sheep_protect(vm, list);
-
-	p = sheep_list(list);
+	list = pos = sheep_make_conses(vm, nr);
 
 	va_start(ap, nr);
 	while (nr--) {
-		p->head = va_arg(ap, sheep_t);
-		p->tail = sheep_make_cons(vm, NULL, NULL);
-		p = sheep_list(p->tail);
+		sheep_list(pos)->head = va_arg(ap, sheep_t);
+		pos = sheep_list(pos)->tail;
 	}
 	va_end(ap);
 
-	sheep_unprotect(vm, list);
 	return list;
 }
 
@@ -302,15 +305,13 @@ int sheep_list_search(struct sheep_list *list, sheep_t object, size_t *offset)
 /* (cons item list) */
 static sheep_t builtin_cons(struct sheep_vm *vm, unsigned int nr_args)
 {
-	sheep_t item, list, new;
+	sheep_t *args, new;
 
 	new = sheep_make_cons(vm, NULL, NULL);
 
-	if (sheep_unpack_stack(vm, nr_args, "ol", &item, &list))
-		return NULL;
-
-	sheep_list(new)->head = item;
-	sheep_list(new)->tail = list;
+	args = sheep_alien_args(vm, nr_args);
+	sheep_list(new)->head = args[0];
+	sheep_list(new)->tail = args[1];
 
 	return new;
 }
@@ -318,37 +319,27 @@ static sheep_t builtin_cons(struct sheep_vm *vm, unsigned int nr_args)
 /* (list expr*) */
 static sheep_t builtin_list(struct sheep_vm *vm, unsigned int nr_args)
 {
-	sheep_t list;
+	sheep_t list, pos;
+	sheep_t *items;
 
-	list = sheep_make_cons(vm, NULL, NULL);
-	sheep_protect(vm, list);
+	list = pos = sheep_make_conses(vm, nr_args);
 
+	vm->stack.nr_items -= nr_args;
+	items = (sheep_t *)vm->stack.items + vm->stack.nr_items;
 	while (nr_args--) {
-		sheep_t new;
-
-		new = sheep_make_cons(vm, NULL, list);
-		sheep_list(new)->head = sheep_vector_pop(&vm->stack);
-
-		sheep_unprotect(vm, list);
-		sheep_protect(vm, new);
-
-		list = new;
+		sheep_list(pos)->head = *items++;
+		pos = sheep_list(pos)->tail;
 	}
 
-	sheep_unprotect(vm, list);
 	return list;
 }
 
 /* (head list) */
 static sheep_t builtin_head(struct sheep_vm *vm, unsigned int nr_args)
 {
-	struct sheep_list *list;
-	sheep_t sheep;
+	sheep_t sheep = *sheep_alien_args(vm, nr_args);
+	struct sheep_list *list = sheep_list(sheep);
 
-	if (sheep_unpack_stack(vm, nr_args, "l", &sheep))
-		return NULL;
-
-	list = sheep_list(sheep);
 	if (list->head)
 		return list->head;
 	return sheep;
@@ -357,13 +348,9 @@ static sheep_t builtin_head(struct sheep_vm *vm, unsigned int nr_args)
 /* (tail list) */
 static sheep_t builtin_tail(struct sheep_vm *vm, unsigned int nr_args)
 {
-	struct sheep_list *list;
-	sheep_t sheep;
+	sheep_t sheep = *sheep_alien_args(vm, nr_args);
+	struct sheep_list *list = sheep_list(sheep);
 
-	if (sheep_unpack_stack(vm, nr_args, "l", &sheep))
-		return NULL;
-
-	list = sheep_list(sheep);
 	if (list->head)
 		return list->tail;
 	return sheep;
@@ -372,15 +359,10 @@ static sheep_t builtin_tail(struct sheep_vm *vm, unsigned int nr_args)
 /* (find predicate list) */
 static sheep_t builtin_find(struct sheep_vm *vm, unsigned int nr_args)
 {
-	sheep_t predicate, list_, result = &sheep_nil;
-	struct sheep_list *list;
-
-	if (sheep_unpack_stack(vm, nr_args, "cl", &predicate, &list_))
-		return NULL;
-	sheep_protect(vm, predicate);
-	sheep_protect(vm, list_);
+	sheep_t *args = sheep_alien_args(vm, nr_args);
+	sheep_t predicate = args[0], result = &sheep_nil;
+	struct sheep_list *list = sheep_list(args[1]);
 
-	list = sheep_list(list_);
 	while (list->head) {
 		sheep_t val;
 
@@ -393,27 +375,20 @@ static sheep_t builtin_find(struct sheep_vm *vm, unsigned int nr_args)
 		list = sheep_list(list->tail);
 	}
 
-	sheep_unprotect(vm, list_);
-	sheep_unprotect(vm, predicate);
 	return result;
 }
 
 /* (filter predicate list) */
 static sheep_t builtin_filter(struct sheep_vm *vm, unsigned int nr_args)
 {
-	sheep_t filter, old_, new_, result = NULL;
-	struct sheep_list *old, *new;
-
-	if (sheep_unpack_stack(vm, nr_args, "cl", &filter, &old_))
-		return NULL;
-	sheep_protect(vm, filter);
-	sheep_protect(vm, old_);
+	sheep_t *args = sheep_alien_args(vm, nr_args);
+	sheep_t filter = args[0], old_ = args[1];
+	sheep_t new_, new, result = NULL;
+	struct sheep_list *old;
 
-	new_ = sheep_make_cons(vm, NULL, NULL);
-	sheep_protect(vm, new_);
+	new_ = new = sheep_make_cons(vm, NULL, NULL);
 
 	old = sheep_list(old_);
-	new = sheep_list(new_);
 
 	while (old->head) {
 		sheep_t value;
@@ -422,80 +397,59 @@ static sheep_t builtin_filter(struct sheep_vm *vm, unsigned int nr_args)
 		if (!value)
 			goto out;
 		if (sheep_test(value)) {
-			new->head = old->head;
-			new->tail = sheep_make_cons(vm, NULL, NULL);
-			new = sheep_list(new->tail);
+			sheep_list_set_head(vm, new, old->head);
+			sheep_list_set_tail(vm, new,
+					sheep_make_cons(vm, NULL, NULL));
+			new = sheep_list(new)->tail;
 		}
 		old = sheep_list(old->tail);
 	}
 	result = new_;
 out:
-	sheep_unprotect(vm, new_);
-	sheep_unprotect(vm, old_);
-	sheep_unprotect(vm, filter);
-
 	return result;
 }
 
 /* (apply function list) */
 static sheep_t builtin_apply(struct sheep_vm *vm, unsigned int nr_args)
 {
-	struct sheep_list *list;
-	sheep_t callable;
-
-	if (sheep_unpack_stack(vm, nr_args, "cL", &callable, &list))
-		return NULL;
+	sheep_t *args = sheep_alien_args(vm, nr_args);
 
-	return sheep_apply(vm, callable, list);
+	return sheep_apply(vm, args[0], sheep_list(args[1]));
 }
 
 /* (map function list) */
 static sheep_t builtin_map(struct sheep_vm *vm, unsigned int nr_args)
 {
-	sheep_t mapper, old_, new_, result = NULL;
-	struct sheep_list *old, *new;
-
-	if (sheep_unpack_stack(vm, nr_args, "cl", &mapper, &old_))
-		return NULL;
-	sheep_protect(vm, mapper);
-	sheep_protect(vm, old_);
+	sheep_t *args = sheep_alien_args(vm, nr_args);
+	sheep_t mapper = args[0], old_ = args[1];
+	sheep_t new_, new, value, result = NULL;
+	struct sheep_list *old;
 
-	new_ = sheep_make_cons(vm, NULL, NULL);
-	sheep_protect(vm, new_);
+	new_ = new = sheep_make_conses(vm, list_length(old_));
 
 	old = sheep_list(old_);
-	new = sheep_list(new_);
 
-	while (old->head) {
-		new->head = sheep_call(vm, mapper, 1, old->head);
-		if (!new->head)
+	/* The mapper might shorten the list, never run off the cells */
+	while (old->head && sheep_list(new)->tail) {
+		value = sheep_call(vm, mapper, 1, old->head);
+		if (!value)
 			goto out;
-		new->tail = sheep_make_cons(vm, NULL, NULL);
-		new = sheep_list(new->tail);
+		sheep_list_set_head(vm, new, value);
+		new = sheep_list(new)->tail;
 		old = sheep_list(old->tail);
 	}
 	result = new_;
 out:
-	sheep_unprotect(vm, new_);
-	sheep_unprotect(vm, old_);
-	sheep_unprotect(vm, mapper);
-
 	return result;
 }
 
 /* (reduce function list) */
 static sheep_t builtin_reduce(struct sheep_vm *vm, unsigned int nr_args)
 {
-	sheep_t reducer, list_, a, b, value, result = NULL;
-	struct sheep_list *list;
+	sheep_t *args = sheep_alien_args(vm, nr_args);
+	sheep_t reducer = args[0], a, b, value, result = NULL;
+	struct sheep_list *list = sheep_list(args[1]);
 
-	if (sheep_unpack_stack(vm, nr_args, "cl", &reducer, &list_))
-		return NULL;
-
-	sheep_protect(vm, reducer);
-	sheep_protect(vm, list_);
-
-	list = sheep_list(list_);
 	if (sheep_unpack_list(vm, list, "oor", &a, &b, &list))
 		goto out;
 
@@ -511,21 +465,18 @@ static sheep_t builtin_reduce(struct sheep_vm *vm, unsigned int nr_args)
 	}
 	result = value;
 out:
-	sheep_unprotect(vm, list_);
-	sheep_unprotect(vm, reducer);
-
 	return result;
 }
 
 void sheep_list_builtins(struct sheep_vm *vm)
 {
-	sheep_vm_function(vm, "cons", builtin_cons);
+	sheep_vm_function_sig(vm, "cons", builtin_cons, "ol");
 	sheep_vm_function(vm, "list", builtin_list);
-	sheep_vm_function(vm, "head", builtin_head);
-	sheep_vm_function(vm, "tail", builtin_tail);
-	sheep_vm_function(vm, "find", builtin_find);
-	sheep_vm_function(vm, "filter", builtin_filter);
-	sheep_vm_function(vm, "apply", builtin_apply);
-	sheep_vm_function(vm, "map", builtin_map);
-	sheep_vm_function(vm, "reduce", builtin_reduce);
+	sheep_vm_function_sig(vm, "head", builtin_head, "l");
+	sheep_vm_function_sig(vm, "tail", builtin_tail, "l");
+	sheep_vm_function_sig(vm, "find", builtin_find, "cl");
+	sheep_vm_function_sig(vm, "filter", builtin_filter, "cl");
+	sheep_vm_function_sig(vm, "apply", builtin_apply, "cL");
+	sheep_vm_function_sig(vm, "map", builtin_map, "cl");
+	sheep_vm_function_sig(vm, "reduce", builtin_reduce, "cl");
 }
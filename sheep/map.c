@@ -8,10 +8,11 @@
 
 #include <sheep/map.h>
 
+/* The key is stored inline, right after the entry */
 struct sheep_map_entry {
-	const char *name;
 	void *value;
 	struct sheep_map_entry *next;
+	char name[];
 };
 
 static int hash(const char *name)
@@ -28,6 +29,7 @@ static struct sheep_map_entry **find(struct sheep_map *map,
 				     int *create)
 {
 	struct sheep_map_entry **pentry, *entry;
+	size_t len;
 	int index;
 
 	index = hash(name) % SHEEP_MAP_SIZE;
@@ -39,8 +41,9 @@ static struct sheep_map_entry **find(struct sheep_map *map,
 	}
 	if (!create)
 		return NULL;
-	entry = sheep_malloc(sizeof(*entry));
-	entry->name = sheep_strdup(name);
+	len = strlen(name) + 1;
+	entry = sheep_malloc(sizeof(*entry) + len);
+	memcpy(entry->name, name, len);
 	entry->next = map->entries[index];
 	map->entries[index] = entry;
 	*create = 1;
@@ -77,7 +80,6 @@ int sheep_map_del(struct sheep_map *map, const char *name)
 		return -1;
 	entry = *pentry;
 	*pentry = entry->next;
-	sheep_free(entry->name);
 	sheep_free(entry);
 	return 0;
 }
@@ -90,7 +92,6 @@ void sheep_map_drain(struct sheep_map *map)
 	for (i = 0; i < SHEEP_MAP_SIZE; i++)
 		for (entry = map->entries[i]; entry; entry = next) {
 			next = entry->next;
-			sheep_free(entry->name);
 			sheep_free(entry);
 		}
 }
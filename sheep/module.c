@@ -14,6 +14,7 @@
 #include <sheep/map.h>
 #include <sheep/vm.h>
 #include <unistd.h>
+#include <string.h>
 #include <dlfcn.h>
 #include <stdio.h>
 
@@ -31,7 +32,6 @@ static void free_module(struct sheep_module *mod)
 	if (mod->handle)
 		dlclose(mod->handle);
 #endif
-	sheep_free(mod);
 }
 
 static void module_free(struct sheep_vm *vm, sheep_t sheep)
@@ -109,11 +109,11 @@ static unsigned int load_sheep(struct sheep_vm *vm,
 		if (!expr)
 			goto out_file;
 		if (expr->object == &sheep_eof) {
-			sheep_free_expr(expr);
+			sheep_free_expr(vm, expr);
 			break;
 		}
 		fun = __sheep_compile(vm, mod, expr);
-		sheep_free_expr(expr);
+		sheep_free_expr(vm, expr);
 		if (!fun)
 			goto out_file;
 		if (!sheep_eval(vm, fun, 0))
@@ -148,13 +148,14 @@ static unsigned int load_path;
 
 sheep_t sheep_module_load(struct sheep_vm *vm, const char *name)
 {
-	struct sheep_module *mod;
+	struct sheep_module mod;
 	struct sheep_list *paths;
-	sheep_t paths_;
+	sheep_t paths_, sheep;
 
-	mod = sheep_zalloc(sizeof(struct sheep_module));
-	mod->name = sheep_strdup(name);
-	sheep_module_variable(vm, mod, "module", sheep_make_string(vm, name));
+	/* Loaded into a local, the object is created on success */
+	memset(&mod, 0, sizeof(struct sheep_module));
+	mod.name = sheep_strdup(name);
+	sheep_module_variable(vm, &mod, "module", sheep_make_string(vm, name));
 
 	paths_ = vm->globals.items[load_path];
 	if (sheep_type(paths_) != &sheep_list_type) {
@@ -172,7 +173,7 @@ sheep_t sheep_module_load(struct sheep_vm *vm, const char *name)
 		}
 
 		path = sheep_rawstring(paths->head);
-		switch (module_load(vm, path, name, mod)) {
+		switch (module_load(vm, path, name, &mod)) {
 		case LOAD_OK:
 			goto found;
 		case LOAD_FAIL:
@@ -185,10 +186,15 @@ sheep_t sheep_module_load(struct sheep_vm *vm, const char *name)
 
 	sheep_error(vm, "module `%s' not found", name);
 err:
-	free_module(mod);
+	free_module(&mod);
 	return NULL;
 found:
-	return sheep_make_object(vm, &sheep_module_type, mod);
+	/* The environment is complete */
+	mod.id = sheep_vm_id(vm);
+	sheep = sheep_make_object(vm, &sheep_module_type,
+				sizeof(struct sheep_module));
+	*(struct sheep_module *)sheep_data(sheep) = mod;
+	return sheep;
 }
 
 unsigned int sheep_module_variable(struct sheep_vm *vm,
@@ -198,7 +204,7 @@ unsigned int sheep_module_variable(struct sheep_vm *vm,
 {
 	unsigned int slot;
 
-	slot = sheep_vector_push(&vm->globals, sheep);
+	slot = sheep_vm_constant(vm, sheep);
 	sheep_map_set(&module->env, name, (void *)(unsigned long)slot);
 	return slot;
 }
@@ -216,9 +222,18 @@ void sheep_module_function(struct sheep_vm *vm,
 
 static sheep_t builtin_load_path(struct sheep_vm *vm)
 {
-	return sheep_make_list(vm, 2,
-			sheep_make_string(vm, "."),
-			sheep_make_string(vm, SHEEP_MODDIR));
+	sheep_t cwd, moddir, list;
+
+	cwd = sheep_make_string(vm, ".");
+	sheep_protect(vm, cwd);
+	moddir = sheep_make_string(vm, SHEEP_MODDIR);
+	sheep_protect(vm, moddir);
+
+	list = sheep_make_list(vm, 2, cwd, moddir);
+
+	sheep_unprotect(vm, moddir);
+	sheep_unprotect(vm, cwd);
+	return list;
 }
 
 void sheep_module_builtins(struct sheep_vm *vm)
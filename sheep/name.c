@@ -12,16 +12,6 @@
 
 #include <sheep/name.h>
 
-static void name_free(struct sheep_vm *vm, sheep_t sheep)
-{
-	struct sheep_name *name;
-
-	name = sheep_name(sheep);
-	sheep_free(*name->parts);
-	sheep_free(name->parts);
-	sheep_free(name);
-}
-
 static int name_equal(sheep_t a, sheep_t b)
 {
 	struct sheep_name *na, *nb;
@@ -50,39 +40,78 @@ static void name_format(sheep_t sheep, struct sheep_strbuf *sb, int repr)
 		sheep_strbuf_addf(sb, ":%s", name->parts[i]);
 }
 
+/* The parts are allocated inline and move along with the object */
+static void name_forward(sheep_t sheep)
+{
+	struct sheep_name *name;
+	unsigned long delta;
+	unsigned int i;
+
+	name = sheep_name(sheep);
+	delta = (unsigned long)(name + 1) - (unsigned long)name->parts;
+	name->parts = (const char **)(name + 1);
+	for (i = 0; i < name->nr_parts; i++)
+		name->parts[i] += delta;
+}
+
 const struct sheep_type sheep_name_type = {
 	.name = "name",
-	.free = name_free,
+	.forward = name_forward,
 	.compile = sheep_compile_name,
 	.equal = name_equal,
 	.format = name_format,
 };
 
-sheep_t sheep_make_name(struct sheep_vm *vm, const char *string)
+/*
+ * Split @work at the colons.  Only counts the parts if @parts is
+ * NULL, @work is left alone in that case.
+ */
+static unsigned int split_name(char *work, const char **parts)
 {
-	struct sheep_name *name;
-	char *work;
-
-	name = sheep_malloc(sizeof(struct sheep_name));
-	name->parts = sheep_malloc(sizeof(char *));
-	name->parts[0] = work = sheep_strdup(string);
-	name->nr_parts = 1;
+	unsigned int nr_parts = 1;
 
+	if (parts)
+		parts[0] = work;
 	while (1) {
 		char *p;
 
 		p = strchr(work, ':');
 		if (!p || p[1] == 0)
-			return sheep_make_object(vm, &sheep_name_type, name);
+			return nr_parts;
 		if (p == work) {
 			work++;
 			continue;
 		}
-		*p = 0;
 		work = p + 1;
-		name->nr_parts++;
-		name->parts = sheep_realloc(name->parts,
-					sizeof(char *) * name->nr_parts);
-		name->parts[name->nr_parts - 1] = work;
+		if (parts) {
+			*p = 0;
+			parts[nr_parts] = work;
+		}
+		nr_parts++;
 	}
 }
+
+/* The parts array and the string are allocated inline */
+sheep_t sheep_make_name(struct sheep_vm *vm, const char *string)
+{
+	unsigned int nr_parts;
+	struct sheep_name *name;
+	size_t len;
+	sheep_t sheep;
+	char *work;
+
+	nr_parts = split_name((char *)string, NULL);
+	len = strlen(string);
+
+	sheep = sheep_make_object(vm, &sheep_name_type,
+				sizeof(struct sheep_name) +
+				sizeof(char *) * nr_parts + len + 1);
+	name = sheep_name(sheep);
+	name->parts = (const char **)(name + 1);
+	name->nr_parts = nr_parts;
+
+	work = (char *)(name->parts + nr_parts);
+	memcpy(work, string, len + 1);
+	split_name(work, name->parts);
+	return sheep;
+}
@@ -6,7 +6,6 @@
 #include <sheep/compile.h>
 #include <sheep/object.h>
 #include <sheep/string.h>
-#include <sheep/unpack.h>
 #include <sheep/bool.h>
 #include <sheep/util.h>
 #include <sheep/vm.h>
@@ -61,10 +60,7 @@ int sheep_parse_number(struct sheep_vm *vm, const char *buf, sheep_t *sheepp)
 /* (number expression) */
 static sheep_t builtin_number(struct sheep_vm *vm, unsigned int nr_args)
 {
-	sheep_t sheep;
-
-	if (sheep_unpack_stack(vm, nr_args, "o", &sheep))
-		return NULL;
+	sheep_t sheep = *sheep_alien_args(vm, nr_args);
 
 	if (sheep_type(sheep) == &sheep_number_type)
 		return sheep;
@@ -97,11 +93,9 @@ static sheep_t do_cmp(struct sheep_vm *vm,
 		      unsigned int nr_args,
 		      enum relation relation)
 {
+	sheep_t *args = sheep_alien_args(vm, nr_args);
+	long a = sheep_fixnum(args[0]), b = sheep_fixnum(args[1]);
 	int result = result;
-	long a, b;
-
-	if (sheep_unpack_stack(vm, nr_args, "NN", &a, &b))
-		return NULL;
 
 	switch (relation) {
 	case LESS:
@@ -151,10 +145,9 @@ static sheep_t do_binop(struct sheep_vm *vm,
 			unsigned int nr_args,
 			char operation)
 {
-	long value, a, b;
-
-	if (sheep_unpack_stack(vm, nr_args, "NN", &a, &b))
-		return NULL;
+	sheep_t *args = sheep_alien_args(vm, nr_args);
+	long a = sheep_fixnum(args[0]), b = sheep_fixnum(args[1]);
+	long value;
 
 	switch (operation) {
 	case '+':
@@ -204,10 +197,8 @@ static sheep_t builtin_plus(struct sheep_vm *vm, unsigned int nr_args)
 static sheep_t builtin_minus(struct sheep_vm *vm, unsigned int nr_args)
 {
 	if (nr_args == 1) {
-		long number;
+		long number = sheep_fixnum(*sheep_alien_args(vm, nr_args));
 
-		if (sheep_unpack_stack(vm, nr_args, "N", &number))
-			return NULL;
 		return sheep_make_number(vm, -number);
 	}
 
@@ -235,10 +226,7 @@ static sheep_t builtin_modulo(struct sheep_vm *vm, unsigned int nr_args)
 /* (~ number) */
 static sheep_t builtin_lnot(struct sheep_vm *vm, unsigned int nr_args)
 {
-	long number;
-
-	if (sheep_unpack_stack(vm, nr_args, "N", &number))
-		return NULL;
+	long number = sheep_fixnum(*sheep_alien_args(vm, nr_args));
 
 	return sheep_make_number(vm, ~number);
 }
@@ -275,24 +263,24 @@ static sheep_t builtin_shiftr(struct sheep_vm *vm, unsigned int nr_args)
 
 void sheep_number_builtins(struct sheep_vm *vm)
 {
-	sheep_vm_function(vm, "number", builtin_number);
-
-	sheep_vm_function(vm, "<", builtin_less);
-	sheep_vm_function(vm, "<=", builtin_lesseq);
-	sheep_vm_function(vm, ">=", builtin_moreeq);
-	sheep_vm_function(vm, ">", builtin_more);
-
-	sheep_vm_function(vm, "+", builtin_plus);
-	sheep_vm_function(vm, "-", builtin_minus);
-	sheep_vm_function(vm, "*", builtin_multiply);
-	sheep_vm_function(vm, "/", builtin_divide);
-	sheep_vm_function(vm, "%", builtin_modulo);
-
-	sheep_vm_function(vm, "~", builtin_lnot);
-	sheep_vm_function(vm, "|", builtin_lor);
-	sheep_vm_function(vm, "&", builtin_land);
-	sheep_vm_function(vm, "^", builtin_lxor);
-
-	sheep_vm_function(vm, "<<", builtin_shiftl);
-	sheep_vm_function(vm, ">>", builtin_shiftr);
+	sheep_vm_function_sig(vm, "number", builtin_number, "o");
+
+	sheep_vm_operator(vm, "<", builtin_less, "NN", SHEEP_LT);
+	sheep_vm_operator(vm, "<=", builtin_lesseq, "NN", SHEEP_LE);
+	sheep_vm_operator(vm, ">=", builtin_moreeq, "NN", SHEEP_GE);
+	sheep_vm_operator(vm, ">", builtin_more, "NN", SHEEP_GT);
+
+	sheep_vm_operator(vm, "+", builtin_plus, "NN", SHEEP_ADD);
+	sheep_vm_operator(vm, "-", builtin_minus, "N|N", SHEEP_SUB);
+	sheep_vm_operator(vm, "*", builtin_multiply, "NN", SHEEP_MUL);
+	sheep_vm_function_sig(vm, "/", builtin_divide, "NN");
+	sheep_vm_function_sig(vm, "%", builtin_modulo, "NN");
+
+	sheep_vm_function_sig(vm, "~", builtin_lnot, "N");
+	sheep_vm_function_sig(vm, "|", builtin_lor, "NN");
+	sheep_vm_function_sig(vm, "&", builtin_land, "NN");
+	sheep_vm_function_sig(vm, "^", builtin_lxor, "NN");
+
+	sheep_vm_function_sig(vm, "<<", builtin_shiftl, "NN");
+	sheep_vm_function_sig(vm, ">>", builtin_shiftr, "NN");
 }
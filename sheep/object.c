@@ -16,14 +16,9 @@
 
 sheep_t sheep_make_object(struct sheep_vm *vm,
 			  const struct sheep_type *type,
-			  void *data)
+			  size_t size)
 {
-	struct sheep_object *sheep;
-
-	sheep = sheep_gc_alloc(vm);
-	sheep->type = type;
-	sheep->data = (unsigned long)data;
-	return sheep;
+	return sheep_gc_alloc(vm, type, size);
 }
 
 int sheep_test(sheep_t sheep)
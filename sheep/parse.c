@@ -15,28 +15,34 @@
 
 #include <sheep/parse.h>
 
-void sheep_parser_error(struct sheep_compile *compile,
-			sheep_t culprit,
-			const char *fmt,
-			...)
+/* Source line of an object of the expression being compiled */
+unsigned long sheep_parser_line(struct sheep_compile *compile, sheep_t object)
 {
 	struct sheep_expr *expr = compile->expr;
-	const char *repr;
 	size_t position;
-	va_list ap;
 
 	if (sheep_type(expr->object) == &sheep_list_type) {
 		struct sheep_list *list = sheep_list(expr->object);
 
 		position = 1; /* list itself is at 0 */
-		sheep_list_search(list, culprit, &position);
+		sheep_list_search(list, object, &position);
 	} else
 		position = 0;
 
+	return (unsigned long)expr->lines.items[position];
+}
+
+void sheep_parser_error(struct sheep_compile *compile,
+			sheep_t culprit,
+			const char *fmt,
+			...)
+{
+	const char *repr;
+	va_list ap;
+
 	repr = sheep_repr(culprit);
-	fprintf(stderr, "%s:%lu: %s: ", expr->filename,
-		(unsigned long)expr->lines.items[position],
-		repr);
+	fprintf(stderr, "%s:%lu: %s: ", compile->expr->filename,
+		sheep_parser_line(compile, culprit), repr);
 	sheep_free(repr);
 
 	va_start(ap, fmt);
@@ -0,0 +1,342 @@
+/*
+ * sheep/profile.c
+ *
+ * Copyright (c) 2010 Johannes Weiner <hannes@cmpxchg.org>
+ */
+#include <sheep/function.h>
+#include <sheep/object.h>
+#include <sheep/alien.h>
+#include <sheep/util.h>
+#include <sheep/map.h>
+#include <sheep/vm.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <sheep/profile.h>
+
+/* Sampling period in microseconds of consumed CPU time */
+#define PROFILE_INTERVAL	1000
+
+/* Innermost call frames recorded per sample */
+#define PROFILE_FRAMES		256
+
+/* A distinct call stack and how often it was sampled */
+struct sheep_sample {
+	unsigned long count;
+	char stack[];
+};
+
+/* The timer is process-wide, only one runtime can be sampled at a time */
+static struct sheep_vm *profiled;
+static struct sigaction old_action;
+
+static void profile_signal(int sig)
+{
+	if (profiled)
+		profiled->profile.pending = 1;
+}
+
+static void drain_samples(struct sheep_profile *profile)
+{
+	unsigned long i;
+
+	for (i = 0; i < profile->samples.nr_items; i++)
+		sheep_free(profile->samples.items[i]);
+	profile->samples.nr_items = 0;
+	sheep_map_drain(&profile->index);
+	memset(&profile->index, 0, sizeof(profile->index));
+	profile->nr_samples = 0;
+}
+
+/**
+ * sheep_profile_start - start sampling the evaluator
+ * @vm: runtime
+ *
+ * Arms a timer that fires every millisecond of CPU time the process
+ * consumes.  The signal only flags the runtime, the evaluator takes
+ * the sample the next time it calls or returns from a function, and
+ * records the function running and the chain of its callers.  Time
+ * spent in aliens is accounted to the function calling them.
+ *
+ * Starts nest, only the outermost one discards the samples of an
+ * earlier profile and only the outermost stop disarms the timer.
+ *
+ * Returns -1 if another runtime is being profiled, 0 otherwise.
+ */
+int sheep_profile_start(struct sheep_vm *vm)
+{
+	struct itimerval timer = {
+		.it_interval = { 0, PROFILE_INTERVAL },
+		.it_value = { 0, PROFILE_INTERVAL },
+	};
+	struct sigaction action;
+
+	if (profiled && profiled != vm)
+		return -1;
+	if (vm->profile.depth++)
+		return 0;
+
+	drain_samples(&vm->profile);
+	profiled = vm;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = profile_signal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, &old_action);
+	setitimer(ITIMER_PROF, &timer, NULL);
+	return 0;
+}
+
+/**
+ * sheep_profile_stop - stop sampling the evaluator
+ * @vm: runtime
+ *
+ * The samples are kept until the next outermost start, see
+ * sheep_profile_report().
+ */
+void sheep_profile_stop(struct sheep_vm *vm)
+{
+	struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+
+	if (!vm->profile.depth || --vm->profile.depth)
+		return;
+
+	setitimer(ITIMER_PROF, &timer, NULL);
+	sigaction(SIGPROF, &old_action, NULL);
+	profiled = NULL;
+	vm->profile.pending = 0;
+}
+
+/**
+ * sheep_profile_unwind - stop the profiles of aborted forms
+ * @vm: runtime
+ *
+ * An error skips the stop at the end of (profile expr), the starts
+ * of all forms that were evaluating are undone here.  Their samples
+ * are dropped without a report.
+ */
+void sheep_profile_unwind(struct sheep_vm *vm)
+{
+	if (!vm->profile.forms)
+		return;
+	while (vm->profile.forms) {
+		vm->profile.forms--;
+		sheep_profile_stop(vm);
+	}
+	if (!vm->profile.depth)
+		drain_samples(&vm->profile);
+}
+
+static void add_function(struct sheep_strbuf *sb, sheep_t sheep)
+{
+	struct sheep_function *function = sheep_function(sheep);
+
+	if (function->name)
+		sheep_strbuf_add(sb, function->name);
+	else
+		sheep_strbuf_addf(sb, "<anonymous:%lu>", function->line);
+}
+
+/**
+ * sheep_profile_sample - record the current call stack
+ * @vm: runtime
+ * @function: the function running
+ *
+ * The callers are taken from the call frames, which must be current.
+ * Functions running in outer evaluator invocations, that called an
+ * alien calling back into sheep code, have no frame and are missing.
+ */
+void sheep_profile_sample(struct sheep_vm *vm, sheep_t function)
+{
+	struct sheep_profile *profile = &vm->profile;
+	struct sheep_strbuf sb = { 0 };
+	struct sheep_sample *sample;
+	unsigned long i = 0;
+	void *entry;
+
+	profile->pending = 0;
+	if (!profile->depth)
+		return;
+
+	if (vm->nr_frames > PROFILE_FRAMES)
+		i = vm->nr_frames - PROFILE_FRAMES;
+	for (; i < vm->nr_frames; i++) {
+		add_function(&sb, vm->frames[i].function);
+		sheep_strbuf_add(&sb, ";");
+	}
+	add_function(&sb, function);
+
+	if (sheep_map_get(&profile->index, sb.bytes, &entry)) {
+		sample = sheep_malloc(sizeof(*sample) + sb.nr_bytes + 1);
+		sample->count = 0;
+		memcpy(sample->stack, sb.bytes, sb.nr_bytes + 1);
+		sheep_vector_push(&profile->samples, sample);
+		sheep_map_set(&profile->index, sample->stack, sample);
+	} else
+		sample = entry;
+	sheep_free(sb.bytes);
+
+	sample->count++;
+	profile->nr_samples++;
+}
+
+/* Samples a function was running in and calling from */
+struct sheep_flat {
+	unsigned long self;
+	unsigned long total;
+	unsigned long seen;
+	const char *name;
+};
+
+static int flat_cmp(const void *a, const void *b)
+{
+	const struct sheep_flat *fa = *(struct sheep_flat **)a;
+	const struct sheep_flat *fb = *(struct sheep_flat **)b;
+
+	if (fa->self != fb->self)
+		return fa->self < fb->self ? 1 : -1;
+	if (fa->total != fb->total)
+		return fa->total < fb->total ? 1 : -1;
+	return strcmp(fa->name, fb->name);
+}
+
+/*
+ * Account a sample to all functions on its stack, but only once to
+ * functions that appear several times, like recursive ones.
+ */
+static void flatten(struct sheep_map *map, struct sheep_vector *flats,
+		    struct sheep_sample *sample, unsigned long nr)
+{
+	char *stack, *name, *next;
+
+	stack = sheep_strdup(sample->stack);
+	for (name = stack; name; name = next) {
+		struct sheep_flat *flat;
+		void *entry;
+
+		next = strchr(name, ';');
+		if (next)
+			*next++ = 0;
+
+		if (sheep_map_get(map, name, &entry)) {
+			flat = sheep_zalloc(sizeof(*flat));
+			flat->name = sheep_strdup(name);
+			sheep_vector_push(flats, flat);
+			sheep_map_set(map, name, flat);
+		} else
+			flat = entry;
+
+		if (flat->seen != nr) {
+			flat->seen = nr;
+			flat->total += sample->count;
+		}
+		if (!next)
+			flat->self += sample->count;
+	}
+	sheep_free(stack);
+}
+
+static void report_flat(struct sheep_profile *profile, FILE *out)
+{
+	struct sheep_vector flats = { 0 };
+	SHEEP_DEFINE_MAP(map);
+	double nr = profile->nr_samples;
+	unsigned long i;
+
+	for (i = 0; i < profile->samples.nr_items; i++)
+		flatten(&map, &flats, profile->samples.items[i], i + 1);
+	qsort(flats.items, flats.nr_items, sizeof(void *), flat_cmp);
+
+	fprintf(out, "%lu samples, %d us each\n",
+		profile->nr_samples, PROFILE_INTERVAL);
+	fprintf(out, "  self%%  total%%     self    total  function\n");
+	for (i = 0; i < flats.nr_items; i++) {
+		struct sheep_flat *flat = flats.items[i];
+
+		fprintf(out, "%6.2f  %6.2f  %7lu  %7lu  %s\n",
+			flat->self * 100 / nr, flat->total * 100 / nr,
+			flat->self, flat->total, flat->name);
+		sheep_free(flat->name);
+		sheep_free(flat);
+	}
+	sheep_free(flats.items);
+	sheep_map_drain(&map);
+}
+
+/**
+ * sheep_profile_report - print the samples taken
+ * @vm: runtime
+ * @flat: stream for the flat profile, or NULL
+ * @folded: stream for the folded call stacks, or NULL
+ *
+ * The flat profile lists the functions by the samples they were
+ * running in, their self time, and the samples they were running or
+ * calling in, their total time.  The folded call stacks list every
+ * distinct stack sampled, outermost function first and separated by
+ * semicolons, followed by the number of samples, one per line, as
+ * expected by flamegraph tools.  Anonymous functions are named by
+ * the line they were defined on.
+ */
+void sheep_profile_report(struct sheep_vm *vm, FILE *flat, FILE *folded)
+{
+	struct sheep_profile *profile = &vm->profile;
+	unsigned long i;
+
+	if (flat && profile->nr_samples)
+		report_flat(profile, flat);
+	if (!folded)
+		return;
+	for (i = 0; i < profile->samples.nr_items; i++) {
+		struct sheep_sample *sample = profile->samples.items[i];
+
+		fprintf(folded, "%s %lu\n", sample->stack, sample->count);
+	}
+}
+
+static sheep_t builtin_profile_start(struct sheep_vm *vm,
+				     unsigned int nr_args)
+{
+	if (sheep_profile_start(vm)) {
+		sheep_error(vm, "another runtime is being profiled");
+		return NULL;
+	}
+	vm->profile.forms++;
+	return &sheep_nil;
+}
+
+static sheep_t builtin_profile_stop(struct sheep_vm *vm, unsigned int nr_args)
+{
+	sheep_t value = *sheep_alien_args(vm, nr_args);
+
+	vm->profile.forms--;
+	sheep_profile_stop(vm);
+	if (!vm->profile.depth) {
+		sheep_profile_report(vm, stderr, NULL);
+		fputc('\n', stderr);
+		sheep_profile_report(vm, NULL, stderr);
+		drain_samples(&vm->profile);
+	}
+	return value;
+}
+
+void sheep_profile_init(struct sheep_vm *vm)
+{
+	vm->profile.start = sheep_vm_constant(vm,
+		sheep_make_alien_sig(vm, builtin_profile_start, "profile", ""));
+	vm->profile.stop = sheep_vm_constant(vm,
+		sheep_make_alien_sig(vm, builtin_profile_stop, "profile", "o"));
+}
+
+void sheep_profile_exit(struct sheep_vm *vm)
+{
+	if (vm->profile.depth) {
+		vm->profile.depth = 1;
+		sheep_profile_stop(vm);
+	}
+	drain_samples(&vm->profile);
+	sheep_free(vm->profile.samples.items);
+}
@@ -112,36 +112,45 @@ static sheep_t read_sexp(struct sheep_reader *reader,
 			 struct sheep_vm *vm,
 			 int c);
 
+/*
+ * The items are kept on the VM stack until the closing parenthesis,
+ * then the list is allocated in one go.
+ */
 static sheep_t read_list(struct sheep_reader *reader,
 			 struct sheep_vector *lines,
 			 struct sheep_vm *vm)
 {
-	sheep_t list, pos;
+	unsigned long base = vm->stack.nr_items;
+	sheep_t list = NULL, pos;
 	int c;
 
-	list = pos = sheep_make_cons(vm, NULL, NULL);
-	sheep_protect(vm, list);
-
 	for (c = next(reader, 0); c != EOF; c = next(reader, 0)) {
-		struct sheep_list *node;
+		sheep_t item;
 
 		if (c == ')') {
-			sheep_unprotect(vm, list);
-			return list;
+			unsigned long i;
+
+			list = pos = sheep_make_conses(vm,
+						vm->stack.nr_items - base);
+			for (i = base; i < vm->stack.nr_items; i++) {
+				sheep_list(pos)->head = vm->stack.items[i];
+				pos = sheep_list(pos)->tail;
+			}
+			goto out;
 		}
 
-		node = sheep_list(pos);
-		node->head = read_sexp(reader, lines, vm, c);
-		if (!node->head)
-			return NULL;
-		if (node->head == &sheep_eof)
+		item = read_sexp(reader, lines, vm, c);
+		if (!item)
+			goto out;
+		if (item == &sheep_eof)
 			break;
-		pos = node->tail = sheep_make_cons(vm, NULL, NULL);
+		sheep_vector_push(&vm->stack, item);
 	}
 
 	barf(reader, "end of file while reading list");
-	sheep_unprotect(vm, list);
-	return NULL;
+out:
+	vm->stack.nr_items = base;
+	return list;
 }
 
 static sheep_t read_sexp(struct sheep_reader *reader,
@@ -165,21 +174,21 @@ static sheep_t read_sexp(struct sheep_reader *reader,
 	return read_atom(reader, vm, c);
 }
 
-void sheep_free_expr(struct sheep_expr *expr)
+void sheep_free_expr(struct sheep_vm *vm, struct sheep_expr *expr)
 {
 	sheep_free(expr->lines.items);
-	sheep_free(expr);
+	sheep_cache_free(&vm->cache, expr, sizeof(struct sheep_expr));
 }
 
 struct sheep_expr *sheep_read(struct sheep_reader *reader, struct sheep_vm *vm)
 {
 	struct sheep_expr *expr;
 
-	expr = sheep_zalloc(sizeof(struct sheep_expr));
+	expr = sheep_cache_zalloc(&vm->cache, sizeof(struct sheep_expr));
 	expr->filename = reader->filename;
 	expr->object = read_sexp(reader, &expr->lines, vm, next(reader, 0));
 	if (expr->object)
 		return expr;
-	sheep_free_expr(expr);
+	sheep_free_expr(vm, expr);
 	return NULL;
 }
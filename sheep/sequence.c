@@ -14,11 +14,8 @@
 /* (length sequence) */
 static sheep_t builtin_length(struct sheep_vm *vm, unsigned int nr_args)
 {
+	sheep_t seq = *sheep_alien_args(vm, nr_args);
 	unsigned int len;
-	sheep_t seq;
-
-	if (sheep_unpack_stack(vm, nr_args, "q", &seq))
-		return NULL;
 
 	len = sheep_sequence(seq)->length(seq);
 	return sheep_make_number(vm, len);
@@ -44,10 +41,7 @@ static sheep_t builtin_concat(struct sheep_vm *vm, unsigned int nr_args)
 /* (reverse sequence) */
 static sheep_t builtin_reverse(struct sheep_vm *vm, unsigned int nr_args)
 {
-	sheep_t seq;
-
-	if (sheep_unpack_stack(vm, nr_args, "q", &seq))
-		return NULL;
+	sheep_t seq = *sheep_alien_args(vm, nr_args);
 
 	return sheep_sequence(seq)->reverse(vm, seq);
 }
@@ -55,23 +49,18 @@ static sheep_t builtin_reverse(struct sheep_vm *vm, unsigned int nr_args)
 /* (nth index sequence) */
 static sheep_t builtin_nth(struct sheep_vm *vm, unsigned int nr_args)
 {
-	unsigned long n;
-	sheep_t seq;
-
-	if (sheep_unpack_stack(vm, nr_args, "Nq", &n, &seq))
-		return NULL;
+	sheep_t *args = sheep_alien_args(vm, nr_args);
+	unsigned long n = sheep_fixnum(args[0]);
 
-	return sheep_sequence(seq)->nth(vm, n, seq);
+	return sheep_sequence(args[1])->nth(vm, n, args[1]);
 }
 
 /* (slice sequence from to) */
 static sheep_t builtin_slice(struct sheep_vm *vm, unsigned int nr_args)
 {
-	long from, to;
-	sheep_t seq;
-
-	if (sheep_unpack_stack(vm, nr_args, "qNN", &seq, &from, &to))
-		return NULL;
+	sheep_t *args = sheep_alien_args(vm, nr_args);
+	long from = sheep_fixnum(args[1]), to = sheep_fixnum(args[2]);
+	sheep_t seq = args[0];
 
 	if (from < 0 || to <= from) {
 		sheep_error(vm, "invalid range [%ld, %ld)", from, to);
@@ -84,20 +73,17 @@ static sheep_t builtin_slice(struct sheep_vm *vm, unsigned int nr_args)
 /* (position item sequence) */
 static sheep_t builtin_position(struct sheep_vm *vm, unsigned int nr_args)
 {
-	sheep_t item, seq;
-
-	if (sheep_unpack_stack(vm, nr_args, "oq", &item, &seq))
-		return NULL;
+	sheep_t *args = sheep_alien_args(vm, nr_args);
 
-	return sheep_sequence(seq)->position(vm, item, seq);
+	return sheep_sequence(args[1])->position(vm, args[0], args[1]);
 }
 
 void sheep_sequence_builtins(struct sheep_vm *vm)
 {
-	sheep_vm_function(vm, "length", builtin_length);
+	sheep_vm_function_sig(vm, "length", builtin_length, "q");
 	sheep_vm_function(vm, "concat", builtin_concat);
-	sheep_vm_function(vm, "reverse", builtin_reverse);
-	sheep_vm_function(vm, "nth", builtin_nth);
-	sheep_vm_function(vm, "slice", builtin_slice);
-	sheep_vm_function(vm, "position", builtin_position);
+	sheep_vm_function_sig(vm, "reverse", builtin_reverse, "q");
+	sheep_vm_function_sig(vm, "nth", builtin_nth, "Nq");
+	sheep_vm_function_sig(vm, "slice", builtin_slice, "qNN");
+	sheep_vm_function_sig(vm, "position", builtin_position, "oq");
 }
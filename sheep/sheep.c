@@ -1,4 +1,5 @@
 #include <sheep/compile.h>
+#include <sheep/profile.h>
 #include <sheep/config.h>
 #include <sheep/string.h>
 #include <sheep/eval.h>
@@ -9,6 +10,30 @@
 #include <string.h>
 #include <stdio.h>
 
+/* File to write the folded call stacks to, if profiling */
+static const char *profile;
+
+static void start_profile(struct sheep_vm *vm)
+{
+	if (profile)
+		sheep_profile_start(vm);
+}
+
+static void finish_profile(struct sheep_vm *vm)
+{
+	FILE *folded;
+
+	if (!profile)
+		return;
+	sheep_profile_stop(vm);
+	folded = fopen(profile, "w");
+	if (!folded)
+		perror(profile);
+	sheep_profile_report(vm, stderr, folded);
+	if (folded)
+		fclose(folded);
+}
+
 static int do_file(int ac, char **av)
 {
 	struct sheep_reader reader;
@@ -22,8 +47,9 @@ static int do_file(int ac, char **av)
 		return 1;
 	}
 
-	sheep_vm_init(&vm, ac, av);
+	sheep_vm_init(&vm, ac, av, NULL);
 	sheep_reader_init(&reader, av[0], in);
+	start_profile(&vm);
 	while (1) {
 		struct sheep_expr *expr;
 		sheep_t fun, val;
@@ -32,11 +58,11 @@ static int do_file(int ac, char **av)
 		if (!expr)
 			goto out;
 		if (expr->object == &sheep_eof) {
-			sheep_free_expr(expr);
+			sheep_free_expr(&vm, expr);
 			break;
 		}
 		fun = sheep_compile(&vm, expr);
-		sheep_free_expr(expr);
+		sheep_free_expr(&vm, expr);
 		if (!fun)
 			goto out;
 		val = sheep_eval(&vm, fun, 0);
@@ -46,6 +72,7 @@ static int do_file(int ac, char **av)
 	ret = 0;
 out:
 	fclose(in);
+	finish_profile(&vm);
 	sheep_vm_exit(&vm);
 	return ret;
 }
@@ -57,9 +84,10 @@ static int do_stdin(int ac, char **av)
 	struct sheep_vm vm;
 
 	gettimeofday(&start, NULL);
-	sheep_vm_init(&vm, ac, av);
+	sheep_vm_init(&vm, ac, av, NULL);
 	sheep_reader_init(&reader, "stdin", stdin);
 	gettimeofday(&end, NULL);
+	start_profile(&vm);
 
 	timersub(&end, &start, &diff);
 	printf("sheep v%s '%s' initialized in %lu.%.6lus\n",
@@ -76,11 +104,11 @@ static int do_stdin(int ac, char **av)
 		if (!expr)
 			continue;
 		if (expr->object == &sheep_eof) {
-			sheep_free_expr(expr);
+			sheep_free_expr(&vm, expr);
 			break;
 		}
 		fun = sheep_compile(&vm, expr);
-		sheep_free_expr(expr);
+		sheep_free_expr(&vm, expr);
 		if (!fun)
 			continue;
 		val = sheep_eval(&vm, fun, 0);
@@ -92,6 +120,7 @@ static int do_stdin(int ac, char **av)
 	}
 
 	puts("bye");
+	finish_profile(&vm);
 	sheep_vm_exit(&vm);
 	return 0;
 }
@@ -99,6 +128,10 @@ static int do_stdin(int ac, char **av)
 int main(int ac, char **av)
 {
 	ac--, av++;
+	if (ac > 1 && !strcmp(av[0], "-p")) {
+		profile = av[1];
+		ac -= 2, av += 2;
+	}
 	if (ac)
 		return do_file(ac, av);
 	else
@@ -14,13 +14,61 @@
 
 #include <sheep/string.h>
 
-static void string_free(struct sheep_vm *vm, sheep_t sheep)
+/*
+ * Longest string whose bytes still fit into the biggest GC cell.
+ * The bytes of longer strings are allocated separately.
+ */
+#define STRING_INLINE_MAX	((1UL << SHEEP_CELL_MAX_SHIFT) -	\
+				 sizeof(struct sheep_object) -		\
+				 sizeof(struct sheep_string) - 1)
+
+static inline char *inline_bytes(struct sheep_string *string)
+{
+	return (char *)(string + 1);
+}
+
+/* Make a string object with room for @len bytes at *@bytesp */
+static sheep_t make_string(struct sheep_vm *vm, size_t len, char **bytesp)
+{
+	struct sheep_string *string;
+	sheep_t sheep;
+	char *bytes;
+
+	if (len > STRING_INLINE_MAX) {
+		sheep = sheep_make_object(vm, &sheep_string_type,
+					sizeof(struct sheep_string));
+		string = sheep_string(sheep);
+		bytes = sheep_malloc(len + 1);
+	} else {
+		sheep = sheep_make_object(vm, &sheep_string_type,
+					sizeof(struct sheep_string) + len + 1);
+		string = sheep_string(sheep);
+		bytes = inline_bytes(string);
+	}
+	bytes[len] = 0;
+	string->bytes = bytes;
+	string->nr_bytes = len;
+	*bytesp = bytes;
+	return sheep;
+}
+
+/* Called on a copy of the payload, see struct sheep_type */
+static void string_release(void *payload)
+{
+	struct sheep_string *string = payload;
+
+	if (string->nr_bytes > STRING_INLINE_MAX)
+		sheep_free(string->bytes);
+}
+
+/* Inline bytes move along with the object */
+static void string_forward(sheep_t sheep)
 {
 	struct sheep_string *string;
 
 	string = sheep_string(sheep);
-	sheep_free(string->bytes);
-	sheep_free(string);
+	if (string->nr_bytes <= STRING_INLINE_MAX)
+		string->bytes = inline_bytes(string);
 }
 
 static int string_test(sheep_t sheep)
@@ -91,25 +139,25 @@ static sheep_t string_reverse(struct sheep_vm *vm, sheep_t sheep)
 	struct sheep_string *string;
 	char *result;
 	size_t pos;
+	sheep_t new;
 
 	string = sheep_string(sheep);
-	result = sheep_malloc(string->nr_bytes + 1);
+	new = make_string(vm, string->nr_bytes, &result);
+
 	for (pos = 0; pos < string->nr_bytes; pos++)
 		result[pos] = string->bytes[string->nr_bytes - pos - 1];
-	result[pos] = 0;
-	return __sheep_make_string(vm, result, pos);
+	return new;
 }
 
 static sheep_t string_nth(struct sheep_vm *vm, size_t n, sheep_t sheep)
 {
 	struct sheep_string *string;
-	char *new;
+	char byte = 0;
 
 	string = sheep_string(sheep);
-	new = sheep_zalloc(1 + 1);
 	if (string->nr_bytes > n)
-		new[0] = string->bytes[n];
-	return __sheep_make_string(vm, new, 1);
+		byte = string->bytes[n];
+	return sheep_copy_string(vm, &byte, 1);
 }
 
 static sheep_t string_slice(struct sheep_vm *vm,
@@ -118,8 +166,8 @@ static sheep_t string_slice(struct sheep_vm *vm,
 			    size_t to)
 {
 	struct sheep_string *string;
-	size_t length = 0;
-	char *new;
+	char *bytes;
+	sheep_t new;
 
 	string = sheep_string(sheep);
 	if (to > string->nr_bytes) {
@@ -127,11 +175,10 @@ static sheep_t string_slice(struct sheep_vm *vm,
 			to, string->nr_bytes);
 		return NULL;
 	}
-	length = to - from;
-	new = sheep_malloc(length + 1);
-	memcpy(new, string->bytes + from, length);
-	new[length] = 0;
-	return __sheep_make_string(vm, new, length);
+	new = make_string(vm, to - from, &bytes);
+
+	memcpy(bytes, string->bytes + from, to - from);
+	return new;
 }
 
 static sheep_t string_position(struct sheep_vm *vm, sheep_t item, sheep_t sheep)
@@ -162,7 +209,8 @@ static const struct sheep_sequence string_sequence = {
 
 const struct sheep_type sheep_string_type = {
 	.name = "string",
-	.free = string_free,
+	.release = string_release,
+	.forward = string_forward,
 	.compile = sheep_compile_constant,
 	.test = string_test,
 	.equal = string_equal,
@@ -170,19 +218,40 @@ const struct sheep_type sheep_string_type = {
 	.sequence = &string_sequence,
 };
 
+/* Make a string from @len bytes at @str, taking over the buffer */
 sheep_t __sheep_make_string(struct sheep_vm *vm, const char *str, size_t len)
 {
 	struct sheep_string *string;
+	sheep_t sheep;
+
+	if (len <= STRING_INLINE_MAX) {
+		sheep = sheep_copy_string(vm, str, len);
+		sheep_free(str);
+		return sheep;
+	}
 
-	string = sheep_malloc(sizeof(struct sheep_string));
+	sheep = sheep_make_object(vm, &sheep_string_type,
+				sizeof(struct sheep_string));
+	string = sheep_string(sheep);
 	string->bytes = str;
 	string->nr_bytes = len;
-	return sheep_make_object(vm, &sheep_string_type, string);
+	return sheep;
+}
+
+/* Make a string from a copy of @len bytes at @str */
+sheep_t sheep_copy_string(struct sheep_vm *vm, const char *str, size_t len)
+{
+	sheep_t sheep;
+	char *bytes;
+
+	sheep = make_string(vm, len, &bytes);
+	memcpy(bytes, str, len);
+	return sheep;
 }
 
 sheep_t sheep_make_string(struct sheep_vm *vm, const char *str)
 {
-	return __sheep_make_string(vm, sheep_strdup(str), strlen(str));
+	return sheep_copy_string(vm, str, strlen(str));
 }
 
 void __sheep_format(sheep_t sheep, struct sheep_strbuf *sb, int repr)
@@ -211,12 +280,9 @@ char *sheep_repr(sheep_t sheep)
 /* (string expression) */
 static sheep_t builtin_string(struct sheep_vm *vm, unsigned int nr_args)
 {
-	sheep_t sheep;
+	sheep_t sheep = *sheep_alien_args(vm, nr_args);
 	char *buf;
 
-	if (sheep_unpack_stack(vm, nr_args, "o", &sheep))
-		return NULL;
-
 	if (sheep_type(sheep) == &sheep_string_type)
 		return sheep;
 
@@ -240,28 +306,36 @@ static char *do_split(char **stringp, const char *delim)
 	return result;
 }
 
+/* Number of items do_split() produces */
+static size_t count_split(const char *string, const char *delim)
+{
+	size_t nr = 1, len = strlen(delim);
+
+	if (!len)
+		return *string ? strlen(string) : 1;
+	while ((string = strstr(string, delim))) {
+		string += len;
+		nr++;
+	}
+	return nr;
+}
+
 /* (split delimiter string) */
 static sheep_t builtin_split(struct sheep_vm *vm, unsigned int nr_args)
 {
-	sheep_t string_, delim_, list_;
-	struct sheep_list *list;
+	sheep_t *args = sheep_alien_args(vm, nr_args);
+	sheep_t delim_ = args[0], string_ = args[1];
+	sheep_t list_, list;
 	const char *delim;
 	char *pos, *orig;
 	int empty;
 
-	if (sheep_unpack_stack(vm, nr_args, "ss", &delim_, &string_))
-		return NULL;
-
-	sheep_protect(vm, delim_);
 	pos = orig = sheep_strdup(sheep_rawstring(string_));
-
-	list_ = sheep_make_cons(vm, NULL, NULL);
-	sheep_protect(vm, list_);
-
 	delim = sheep_rawstring(delim_);
 	empty = sheep_string(delim_)->nr_bytes == 0;
 
-	list = sheep_list(list_);
+	list_ = list = sheep_make_conses(vm, count_split(pos, delim));
+
 	while (pos) {
 		sheep_t item;
 		/*
@@ -279,15 +353,11 @@ static sheep_t builtin_split(struct sheep_vm *vm, unsigned int nr_args)
 		} else
 			item = sheep_make_string(vm, do_split(&pos, delim));
 
-		list->head = item;
-		list->tail = sheep_make_cons(vm, NULL, NULL);
-		list = sheep_list(list->tail);
+		sheep_list_set_head(vm, list, item);
+		list = sheep_list(list)->tail;
 	}
 	sheep_free(orig);
 
-	sheep_unprotect(vm, list_);
-	sheep_unprotect(vm, delim_);
-
 	return list_;
 }
 
@@ -297,17 +367,12 @@ static sheep_t builtin_join(struct sheep_vm *vm, unsigned int nr_args)
 	char *new = NULL, *result = NULL;
 	struct sheep_string *delim;
 	struct sheep_list *list;
-	sheep_t delim_, list_;
 	size_t length = 0;
+	sheep_t *args;
 
-	if (sheep_unpack_stack(vm, nr_args, "sl", &delim_, &list_))
-		return NULL;
-
-	sheep_protect(vm, delim_);
-	sheep_protect(vm, list_);
-
-	delim = sheep_string(delim_);
-	list = sheep_list(list_);
+	args = sheep_alien_args(vm, nr_args);
+	delim = sheep_string(args[0]);
+	list = sheep_list(args[1]);
 
 	while (list->head) {
 		struct sheep_string *string;
@@ -331,9 +396,6 @@ static sheep_t builtin_join(struct sheep_vm *vm, unsigned int nr_args)
 	else
 		result = sheep_strdup("");
 out:
-	sheep_unprotect(vm, list_);
-	sheep_unprotect(vm, delim_);
-
 	if (result)
 		return __sheep_make_string(vm, result, length);
 	return NULL;
@@ -362,8 +424,8 @@ static sheep_t builtin_print(struct sheep_vm *vm, unsigned int nr_args)
 
 void sheep_string_builtins(struct sheep_vm *vm)
 {
-	sheep_vm_function(vm, "string", builtin_string);
-	sheep_vm_function(vm, "split", builtin_split);
-	sheep_vm_function(vm, "join", builtin_join);
+	sheep_vm_function_sig(vm, "string", builtin_string, "o");
+	sheep_vm_function_sig(vm, "split", builtin_split, "ss");
+	sheep_vm_function_sig(vm, "join", builtin_join, "sl");
 	sheep_vm_function(vm, "print", builtin_print);
 }
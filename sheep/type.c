@@ -8,6 +8,7 @@
 #include <sheep/map.h>
 #include <sheep/gc.h>
 #include <sheep/vm.h>
+#include <string.h>
 #include <stdio.h>
 
 #include <sheep/type.h>
@@ -26,14 +27,18 @@ static void typeobject_mark(sheep_t sheep)
 		sheep_mark(object->values[i]);
 }
 
-static void typeobject_free(struct sheep_vm *vm, sheep_t sheep)
+static void typeobject_forward(sheep_t sheep)
 {
 	struct sheep_typeobject *object;
+	struct sheep_typeclass *class;
+	unsigned int i;
 
 	object = sheep_data(sheep);
-	sheep_free(object->values);
-	sheep_map_drain(&object->map);
-	sheep_free(object);
+	object->class = sheep_forward(object->class);
+	class = sheep_data(object->class);
+
+	for (i = 0; i < class->nr_slots; i++)
+		object->values[i] = sheep_forward(object->values[i]);
 }
 
 static void typeobject_format(sheep_t sheep, struct sheep_strbuf *sb, int repr)
@@ -47,21 +52,20 @@ static void typeobject_format(sheep_t sheep, struct sheep_strbuf *sb, int repr)
 const struct sheep_type sheep_typeobject_type = {
 	.name = "object",
 	.mark = typeobject_mark,
-	.free = typeobject_free,
+	.forward = typeobject_forward,
 	.format = typeobject_format,
 };
 
-static void typeclass_free(struct sheep_vm *vm, sheep_t sheep)
+static void typeclass_release(void *payload)
 {
-	struct sheep_typeclass *class;
+	struct sheep_typeclass *class = payload;
 	unsigned int i;
 
-	class = sheep_data(sheep);
+	sheep_map_drain(&class->map);
 	sheep_free(class->name);
 	for (i = 0; i < class->nr_slots; i++)
 		sheep_free(class->names[i]);
 	sheep_free(class->names);
-	sheep_free(class);
 }
 
 static enum sheep_call typeclass_call(struct sheep_vm *vm,
@@ -79,15 +83,14 @@ static enum sheep_call typeclass_call(struct sheep_vm *vm,
 		return SHEEP_CALL_FAIL;
 	}
 
-	object = sheep_zalloc(sizeof(struct sheep_typeobject));
+	/* Allocate before popping, the values are rooted on the stack */
+	*valuep = sheep_make_object(vm, &sheep_typeobject_type,
+				sizeof(struct sheep_typeobject) +
+				sizeof(sheep_t) * class->nr_slots);
+	object = sheep_data(*valuep);
 	object->class = callable;
-	object->values = sheep_malloc(sizeof(sheep_t *) * class->nr_slots);
-	while (nr_args--) {
+	while (nr_args--)
 		object->values[nr_args] = sheep_vector_pop(&vm->stack);
-		sheep_map_set(&object->map, class->names[nr_args],
-			(void *)(unsigned long)nr_args);
-	}
-	*valuep = sheep_make_object(vm, &sheep_typeobject_type, object);
 	return SHEEP_CALL_DONE;
 }
 
@@ -104,7 +107,7 @@ static void typeclass_format(sheep_t sheep, struct sheep_strbuf *sb, int repr)
 
 const struct sheep_type sheep_typeclass_type = {
 	.name = "type",
-	.free = typeclass_free,
+	.release = typeclass_release,
 	.call = typeclass_call,
 	.format = typeclass_format,
 };
@@ -115,11 +118,19 @@ sheep_t sheep_make_typeclass(struct sheep_vm *vm,
 			     unsigned int nr_slots)
 {
 	struct sheep_typeclass *class;
+	unsigned int i;
+	sheep_t sheep;
 
-	class = sheep_malloc(sizeof(struct sheep_typeclass));
+	sheep = sheep_make_object(vm, &sheep_typeclass_type,
+				sizeof(struct sheep_typeclass));
+	class = sheep_data(sheep);
 	class->name = sheep_strdup(name);
 	class->names = names;
 	class->nr_slots = nr_slots;
+	class->id = sheep_vm_id(vm);
+	memset(&class->map, 0, sizeof(struct sheep_map));
+	for (i = 0; i < nr_slots; i++)
+		sheep_map_set(&class->map, names[i], (void *)(unsigned long)i);
 
-	return sheep_make_object(vm, &sheep_typeclass_type, class);
+	return sheep;
 }
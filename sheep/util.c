@@ -11,6 +11,46 @@
 
 #include <sheep/util.h>
 
+static void *libc_alloc(size_t size, void *data)
+{
+	return malloc(size);
+}
+
+static void *libc_realloc(void *mem, size_t size, void *data)
+{
+	return realloc(mem, size);
+}
+
+static void libc_free(void *mem, void *data)
+{
+	free(mem);
+}
+
+static struct sheep_allocator allocator = {
+	.alloc = libc_alloc,
+	.realloc = libc_realloc,
+	.free = libc_free,
+};
+
+/**
+ * sheep_set_allocator - route memory allocation to other hooks
+ * @hooks: the new allocator, NULL for the C library
+ *
+ * Must be called before the first VM is set up, memory is always
+ * freed through the hooks that allocated it.
+ */
+void sheep_set_allocator(const struct sheep_allocator *hooks)
+{
+	if (hooks)
+		allocator = *hooks;
+	else {
+		allocator.alloc = libc_alloc;
+		allocator.realloc = libc_realloc;
+		allocator.free = libc_free;
+		allocator.data = NULL;
+	}
+}
+
 static void *massert(void *mem)
 {
 	if (mem)
@@ -21,27 +61,133 @@ static void *massert(void *mem)
 
 void *sheep_malloc(size_t size)
 {
-	return massert(malloc(size));
+	return massert(allocator.alloc(size, allocator.data));
 }
 
 void *sheep_zalloc(size_t size)
 {
-	return massert(calloc(1, size));
+	return memset(sheep_malloc(size), 0, size);
 }
 
 void *sheep_realloc(void *mem, size_t size)
 {
-	return massert(realloc(mem, size));
+	if (!mem)
+		return sheep_malloc(size);
+	return massert(allocator.realloc(mem, size, allocator.data));
 }
 
 char *sheep_strdup(const char *str)
 {
-	return massert(strdup(str));
+	size_t size = strlen(str) + 1;
+
+	return memcpy(sheep_malloc(size), str, size);
 }
 
 void sheep_free(const void *mem)
 {
-	free((void *)mem);
+	if (mem)
+		allocator.free((void *)mem, allocator.data);
+}
+
+/*
+ * Cache chunks start with their list linkage, padded to the
+ * smallest size class to keep the objects aligned.
+ */
+#define CACHE_CHUNK	4096
+#define CACHE_HEADER	(1UL << SHEEP_CACHE_MIN_SHIFT)
+
+static inline unsigned int cache_class(size_t size)
+{
+	if (size <= 1UL << SHEEP_CACHE_MIN_SHIFT)
+		return 0;
+	return sizeof(long) * 8 - __builtin_clzl(size - 1) -
+		SHEEP_CACHE_MIN_SHIFT;
+}
+
+static void *cache_refill(struct sheep_cache *cache, unsigned int class)
+{
+	size_t offset, size = 1UL << (class + SHEEP_CACHE_MIN_SHIFT);
+	void **free = NULL;
+	char *chunk;
+
+	chunk = sheep_malloc(CACHE_CHUNK);
+	*(void **)chunk = cache->chunks;
+	cache->chunks = chunk;
+	cache->nr_chunk_bytes += CACHE_CHUNK;
+
+	/* Thread the free list backwards to hand out ascending addresses */
+	for (offset = CACHE_CHUNK - size; offset >= CACHE_HEADER;
+	     offset -= size) {
+		void **object = (void **)(chunk + offset);
+
+		*object = free;
+		free = object;
+	}
+	return free;
+}
+
+/**
+ * sheep_cache_alloc - allocate from a cache
+ * @cache: the cache
+ * @size: size of the allocation
+ *
+ * Allocations bigger than the largest size class are passed on to
+ * sheep_malloc(), but still accounted to the cache.
+ */
+void *sheep_cache_alloc(struct sheep_cache *cache, size_t size)
+{
+	unsigned int class;
+	void **object;
+
+	cache->nr_bytes += size;
+	if (size > 1UL << SHEEP_CACHE_MAX_SHIFT)
+		return sheep_malloc(size);
+
+	class = cache_class(size);
+	object = cache->free[class];
+	if (!object)
+		object = cache_refill(cache, class);
+	cache->free[class] = *object;
+	return object;
+}
+
+void *sheep_cache_zalloc(struct sheep_cache *cache, size_t size)
+{
+	return memset(sheep_cache_alloc(cache, size), 0, size);
+}
+
+/**
+ * sheep_cache_free - return an allocation to its cache
+ * @cache: the cache it was allocated from
+ * @mem: the allocation, or NULL
+ * @size: the size it was allocated with
+ */
+void sheep_cache_free(struct sheep_cache *cache, const void *mem, size_t size)
+{
+	unsigned int class;
+
+	if (!mem)
+		return;
+	cache->nr_bytes -= size;
+	if (size > 1UL << SHEEP_CACHE_MAX_SHIFT) {
+		sheep_free(mem);
+		return;
+	}
+	class = cache_class(size);
+	*(void **)mem = cache->free[class];
+	cache->free[class] = (void *)mem;
+}
+
+/* Release all chunks, allocations still handed out become invalid */
+void sheep_cache_exit(struct sheep_cache *cache)
+{
+	void *chunk, *next;
+
+	for (chunk = cache->chunks; chunk; chunk = next) {
+		next = *(void **)chunk;
+		sheep_free(chunk);
+	}
+	memset(cache, 0, sizeof(*cache));
 }
 
 void sheep_strbuf_addn(struct sheep_strbuf *sb, const char *str, size_t n)
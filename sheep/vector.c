@@ -50,8 +50,13 @@ static unsigned long fls(unsigned long word)
 	return num;
 }
 
+/* Smallest allocation, saving the first few doublings */
+#define VECTOR_MIN	4
+
 static void vector_resize(struct sheep_vector *vec, unsigned long goal)
 {
+	if (goal < VECTOR_MIN)
+		goal = VECTOR_MIN;
 	vec->nr_alloc = 1UL << fls(goal - 1);
 	vec->items = sheep_realloc(vec->items, vec->nr_alloc * sizeof(void *));
 }
@@ -64,15 +69,27 @@ unsigned long sheep_vector_push(struct sheep_vector *vec, void *item)
 	return vec->nr_items++;
 }
 
+/*
+ * Vectors never shrink: the evaluator relies on stack space it
+ * reserved staying put, and stacks tend to grow back anyway.
+ */
 void *sheep_vector_pop(struct sheep_vector *vec)
 {
-	void *item;
+	return vec->items[--vec->nr_items];
+}
 
-	vec->nr_items -= 1;
-	item = vec->items[vec->nr_items];
-	if (vec->nr_items && vec->nr_items < (vec->nr_alloc >> 3))
-		vector_resize(vec, vec->nr_items);
-	return item;
+/**
+ * sheep_vector_reserve - make room for more items
+ * @vec: the vector
+ * @delta: number of items to make room for
+ *
+ * The next @delta items can be stored beyond the end of the vector
+ * without reallocating it.
+ */
+void sheep_vector_reserve(struct sheep_vector *vec, unsigned long delta)
+{
+	if (vec->nr_items + delta > vec->nr_alloc)
+		vector_resize(vec, vec->nr_items + delta);
 }
 
 void sheep_vector_grow(struct sheep_vector *vec, unsigned long delta)
@@ -80,8 +97,7 @@ void sheep_vector_grow(struct sheep_vector *vec, unsigned long delta)
 	unsigned long want;
 
 	want = vec->nr_items + delta;
-	if (want >= vec->nr_alloc)
-		vector_resize(vec, want);
+	sheep_vector_reserve(vec, delta);
 	while (vec->nr_items < want)
 		vec->items[vec->nr_items++] = NULL;
 }
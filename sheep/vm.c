@@ -5,6 +5,7 @@
  */
 #include <sheep/function.h>
 #include <sheep/sequence.h>
+#include <sheep/profile.h>
 #include <sheep/number.h>
 #include <sheep/object.h>
 #include <sheep/string.h>
@@ -15,8 +16,10 @@
 #include <sheep/list.h>
 #include <sheep/type.h>
 #include <sheep/util.h>
+#include <sheep/weak.h>
 #include <sheep/gc.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -92,6 +95,18 @@ static void drain_keys(struct sheep_vm *vm)
 	sheep_free(vm->keys);
 }
 
+void sheep_vm_mark_frames(struct sheep_vm *vm)
+{
+	unsigned int i;
+
+	for (i = 0; i < vm->stack.nr_items; i++)
+		if (vm->stack.items[i])
+			sheep_mark(vm->stack.items[i]);
+
+	for (i = 0; i < vm->nr_frames; i++)
+		sheep_mark(vm->frames[i].function);
+}
+
 void sheep_vm_mark(struct sheep_vm *vm)
 {
 	unsigned int i;
@@ -100,12 +115,7 @@ void sheep_vm_mark(struct sheep_vm *vm)
 		if (vm->globals.items[i])
 			sheep_mark(vm->globals.items[i]);
 
-	for (i = 0; i < vm->stack.nr_items; i++)
-		if (vm->stack.items[i])
-			sheep_mark(vm->stack.items[i]);
-
-	for (i = 2; i < vm->calls.nr_items; i += 3)
-		sheep_mark(vm->calls.items[i]);
+	sheep_vm_mark_frames(vm);
 }
 
 unsigned int sheep_vm_variable(struct sheep_vm *vm,
@@ -124,29 +134,70 @@ void sheep_vm_function(struct sheep_vm *vm, const char *name, sheep_alien_t f)
 	sheep_vm_variable(vm, name, sheep_make_alien(vm, f, name));
 }
 
+void sheep_vm_function_sig(struct sheep_vm *vm, const char *name,
+			   sheep_alien_t f, const char *sig)
+{
+	sheep_vm_variable(vm, name, sheep_make_alien_sig(vm, f, name, sig));
+}
+
+/**
+ * sheep_vm_operator - register a builtin operator
+ * @vm: runtime
+ * @name: name of the global
+ * @f: the builtin function
+ * @sig: its signature, see sheep_make_alien_sig()
+ * @op: instruction to replace calls with two arguments
+ *
+ * Where @name refers to @f at compile time, the compiler emits @op
+ * instead of calling it, which handles fixnums inline.  Other
+ * operands, or @name having been assigned something else by the
+ * time the instruction runs, make it fall back to a regular call.
+ */
+void sheep_vm_operator(struct sheep_vm *vm, const char *name, sheep_alien_t f,
+		       const char *sig, enum sheep_opcode op)
+{
+	sheep_t alien;
+
+	/* A root of its own, see mark_operators() */
+	alien = sheep_make_alien_sig(vm, f, name, sig);
+	vm->operators[op - SHEEP_ADD] = alien;
+	sheep_vm_variable(vm, name, alien);
+}
+
 static void setup_argv(struct sheep_vm *vm, int ac, char **av)
 {
-	struct sheep_list *p;
-	sheep_t list;
+	sheep_t list, pos;
 
-	list = sheep_make_cons(vm, NULL, NULL);
-	sheep_protect(vm, list);
+	list = pos = sheep_make_conses(vm, ac);
 
-	p = sheep_list(list);
 	while (ac--) {
-		p->head = sheep_make_string(vm, *av);
-		p->tail = sheep_make_cons(vm, NULL, NULL);
-		p = sheep_list(p->tail);
+		sheep_list_set_head(vm, pos, sheep_make_string(vm, *av));
+		pos = sheep_list(pos)->tail;
 		av++;
 	}
 
 	sheep_vm_variable(vm, "argv", list);
-	sheep_unprotect(vm, list);
 }
 
-void sheep_vm_init(struct sheep_vm *vm, int ac, char **av)
+#ifdef SHEEP_COUNTS
+/* Instructions are counted when SHEEP_COUNTS is set in the environment */
+static void setup_counts(struct sheep_vm *vm)
+{
+	const char *env = getenv("SHEEP_COUNTS");
+
+	vm->counts.enabled = env && *env && strcmp(env, "0");
+}
+#else
+static inline void setup_counts(struct sheep_vm *vm)
+{
+}
+#endif
+
+void sheep_vm_init(struct sheep_vm *vm, int ac, char **av,
+		   const struct sheep_gc_policy *policy)
 {
 	memset(vm, 0, sizeof(*vm));
+	sheep_gc_init(vm, policy);
 	sheep_core_init(vm);
 	sheep_object_builtins(vm);
 	sheep_bool_builtins(vm);
@@ -156,15 +207,25 @@ void sheep_vm_init(struct sheep_vm *vm, int ac, char **av)
 	sheep_sequence_builtins(vm);
 	sheep_function_builtins(vm);
 	sheep_module_builtins(vm);
+	sheep_gc_builtins(vm);
+	sheep_weak_builtins(vm);
+	sheep_profile_init(vm);
 	setup_argv(vm, ac, av);
+	setup_counts(vm);
 }
 
 void sheep_vm_exit(struct sheep_vm *vm)
 {
+#ifdef SHEEP_COUNTS
+	if (vm->counts.enabled)
+		sheep_code_histogram(&vm->counts);
+#endif
+	sheep_profile_exit(vm);
 	sheep_map_drain(&vm->builtins);
 	sheep_core_exit(vm);
 	sheep_evaluator_exit(vm);
 	sheep_free(vm->globals.items);
 	drain_keys(vm);
 	sheep_gc_exit(vm);
+	sheep_cache_exit(&vm->cache);
 }
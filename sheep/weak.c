@@ -0,0 +1,314 @@
+/*
+ * sheep/weak.c
+ *
+ * Copyright (c) 2010 Johannes Weiner <hannes@cmpxchg.org>
+ */
+#include <sheep/string.h>
+#include <sheep/object.h>
+#include <sheep/unpack.h>
+#include <sheep/util.h>
+#include <sheep/gc.h>
+#include <sheep/vm.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <sheep/weak.h>
+
+static void weak_weak(sheep_t sheep)
+{
+	struct sheep_weak *weak = sheep_data(sheep);
+
+	if (!sheep_gc_alive(weak->object))
+		weak->object = NULL;
+}
+
+static void weak_forward(sheep_t sheep)
+{
+	struct sheep_weak *weak = sheep_data(sheep);
+
+	weak->object = sheep_forward(weak->object);
+}
+
+static void weak_format(sheep_t sheep, struct sheep_strbuf *sb, int repr)
+{
+	sheep_strbuf_addf(sb, "#<weak '%p'>", sheep);
+}
+
+const struct sheep_type sheep_weak_type = {
+	.name = "weak",
+	.weak = weak_weak,
+	.forward = weak_forward,
+	.format = weak_format,
+};
+
+sheep_t sheep_make_weak(struct sheep_vm *vm, sheep_t object)
+{
+	sheep_t sheep;
+
+	sheep = sheep_make_object(vm, &sheep_weak_type,
+				sizeof(struct sheep_weak));
+	((struct sheep_weak *)sheep_data(sheep))->object = object;
+	/* Weak objects live outside of allocation regions */
+	sheep_gc_write(vm, sheep, object);
+	sheep_gc_weak(vm, sheep);
+	return sheep;
+}
+
+static unsigned long hash(sheep_t key)
+{
+	unsigned long h = (unsigned long)key;
+
+	if (sheep_type(key) == &sheep_string_type) {
+		struct sheep_string *string = sheep_string(key);
+		size_t i;
+
+		h = 0;
+		for (i = 0; i < string->nr_bytes; i++)
+			h = h * 31 + (unsigned char)string->bytes[i];
+	}
+	return h * 0x9e3779b97f4a7c15UL >> 16;
+}
+
+static int match(sheep_t a, sheep_t b)
+{
+	if (a == b)
+		return 1;
+	if (sheep_type(a) != &sheep_string_type)
+		return 0;
+	return sheep_equal(a, b);
+}
+
+static struct sheep_ephemeron *lookup(struct sheep_weak_table *table,
+				      sheep_t key)
+{
+	unsigned long i, mask = table->nr_entries - 1;
+
+	if (!table->nr_entries)
+		return NULL;
+	for (i = hash(key) & mask;; i = (i + 1) & mask) {
+		struct sheep_ephemeron *entry = &table->entries[i];
+
+		if (!entry->key || match(entry->key, key))
+			return entry;
+	}
+}
+
+/* Rehash the entries into a table of @nr_entries, dropping dead ones */
+static void rehash(struct sheep_weak_table *table, unsigned long nr_entries)
+{
+	struct sheep_ephemeron *old = table->entries;
+	unsigned long i, nr_old = table->nr_entries;
+
+	table->entries = sheep_zalloc(nr_entries * sizeof(*old));
+	table->nr_entries = nr_entries;
+	table->nr_used = 0;
+
+	for (i = 0; i < nr_old; i++) {
+		struct sheep_ephemeron *entry;
+
+		if (!old[i].key)
+			continue;
+		entry = lookup(table, old[i].key);
+		*entry = old[i];
+		table->nr_used++;
+	}
+	sheep_free(old);
+}
+
+/* Mark the values of live keys */
+static int weak_table_ephemeron(sheep_t sheep)
+{
+	struct sheep_weak_table *table = sheep_data(sheep);
+	unsigned long i;
+	int marked = 0;
+
+	for (i = 0; i < table->nr_entries; i++) {
+		struct sheep_ephemeron *entry = &table->entries[i];
+
+		if (!entry->key || !sheep_gc_alive(entry->key))
+			continue;
+		if (sheep_gc_alive(entry->value))
+			continue;
+		sheep_mark(entry->value);
+		marked = 1;
+	}
+	return marked;
+}
+
+static void weak_table_weak(sheep_t sheep)
+{
+	struct sheep_weak_table *table = sheep_data(sheep);
+	unsigned long i, nr_entries, nr_dead = 0;
+
+	for (i = 0; i < table->nr_entries; i++) {
+		struct sheep_ephemeron *entry = &table->entries[i];
+
+		if (!entry->key || sheep_gc_alive(entry->key))
+			continue;
+		entry->key = entry->value = NULL;
+		table->nr_used--;
+		nr_dead++;
+	}
+	if (!nr_dead)
+		return;
+
+	/* The probe sequences have holes now, shrink while at it */
+	nr_entries = table->nr_entries;
+	while (nr_entries > 8 && 8 * table->nr_used < nr_entries)
+		nr_entries /= 2;
+	rehash(table, nr_entries);
+}
+
+/* Keys hashed by address have moved */
+static void weak_table_forward(sheep_t sheep)
+{
+	struct sheep_weak_table *table = sheep_data(sheep);
+	unsigned long i;
+
+	for (i = 0; i < table->nr_entries; i++) {
+		struct sheep_ephemeron *entry = &table->entries[i];
+
+		entry->key = sheep_forward(entry->key);
+		entry->value = sheep_forward(entry->value);
+	}
+	if (table->nr_entries)
+		rehash(table, table->nr_entries);
+}
+
+/* Called on a copy of the payload, see struct sheep_type */
+static void weak_table_release(void *payload)
+{
+	struct sheep_weak_table *table = payload;
+
+	sheep_free(table->entries);
+}
+
+static void weak_table_format(sheep_t sheep, struct sheep_strbuf *sb, int repr)
+{
+	sheep_strbuf_addf(sb, "#<weak-table '%p'>", sheep);
+}
+
+const struct sheep_type sheep_weak_table_type = {
+	.name = "weak-table",
+	.release = weak_table_release,
+	.ephemeron = weak_table_ephemeron,
+	.weak = weak_table_weak,
+	.forward = weak_table_forward,
+	.format = weak_table_format,
+};
+
+sheep_t sheep_make_weak_table(struct sheep_vm *vm)
+{
+	sheep_t sheep;
+
+	sheep = sheep_make_object(vm, &sheep_weak_table_type,
+				sizeof(struct sheep_weak_table));
+	memset(sheep_data(sheep), 0, sizeof(struct sheep_weak_table));
+	sheep_gc_weak(vm, sheep);
+	return sheep;
+}
+
+/* The value stored under @key, or NULL */
+sheep_t sheep_weak_table_get(sheep_t sheep, sheep_t key)
+{
+	struct sheep_ephemeron *entry;
+
+	entry = lookup(sheep_data(sheep), key);
+	if (!entry || !entry->key)
+		return NULL;
+	return entry->value;
+}
+
+void sheep_weak_table_set(struct sheep_vm *vm, sheep_t sheep,
+			  sheep_t key, sheep_t value)
+{
+	struct sheep_weak_table *table = sheep_data(sheep);
+	struct sheep_ephemeron *entry;
+
+	/* Keep at least half of the slots free */
+	if (2 * (table->nr_used + 1) > table->nr_entries)
+		rehash(table, table->nr_entries ? 2 * table->nr_entries : 8);
+
+	entry = lookup(table, key);
+	if (!entry->key) {
+		entry->key = key;
+		table->nr_used++;
+	}
+	entry->value = value;
+	/*
+	 * Old tables are settled by full collections only, young keys
+	 * and values stored into them survive until then.
+	 */
+	sheep_gc_write(vm, sheep, key);
+	sheep_gc_write(vm, sheep, value);
+}
+
+/* (weak object) */
+static sheep_t builtin_weak(struct sheep_vm *vm, unsigned int nr_args)
+{
+	sheep_t object;
+
+	if (sheep_unpack_stack(vm, nr_args, "o", &object))
+		return NULL;
+
+	return sheep_make_weak(vm, object);
+}
+
+/* (weak-ref weak) => object, or nil if it has been collected */
+static sheep_t builtin_weak_ref(struct sheep_vm *vm, unsigned int nr_args)
+{
+	struct sheep_weak *weak;
+
+	if (sheep_unpack_stack(vm, nr_args, "T", &sheep_weak_type, &weak))
+		return NULL;
+
+	if (!weak->object)
+		return &sheep_nil;
+	return weak->object;
+}
+
+/* (weak-table) */
+static sheep_t builtin_weak_table(struct sheep_vm *vm, unsigned int nr_args)
+{
+	if (sheep_unpack_stack(vm, nr_args, ""))
+		return NULL;
+
+	return sheep_make_weak_table(vm);
+}
+
+/* (weak-get table key) => value, or nil if there is none */
+static sheep_t builtin_weak_get(struct sheep_vm *vm, unsigned int nr_args)
+{
+	sheep_t table, key, value;
+
+	if (sheep_unpack_stack(vm, nr_args, "to", &sheep_weak_table_type,
+			       &table, &key))
+		return NULL;
+
+	value = sheep_weak_table_get(table, key);
+	if (!value)
+		return &sheep_nil;
+	return value;
+}
+
+/* (weak-set table key value) => value */
+static sheep_t builtin_weak_set(struct sheep_vm *vm, unsigned int nr_args)
+{
+	sheep_t table, key, value;
+
+	if (sheep_unpack_stack(vm, nr_args, "too", &sheep_weak_table_type,
+			       &table, &key, &value))
+		return NULL;
+
+	sheep_weak_table_set(vm, table, key, value);
+	return value;
+}
+
+void sheep_weak_builtins(struct sheep_vm *vm)
+{
+	sheep_vm_function(vm, "weak", builtin_weak);
+	sheep_vm_function(vm, "weak-ref", builtin_weak_ref);
+	sheep_vm_function(vm, "weak-table", builtin_weak_table);
+	sheep_vm_function(vm, "weak-get", builtin_weak_get);
+	sheep_vm_function(vm, "weak-set", builtin_weak_set);
+}